@@ -0,0 +1,126 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include "arena.hpp"
+
+#define BLOCK_SIZE  (64 * 1024)
+
+// Allocations larger than this get a dedicated block
+#define LARGE_SIZE  (BLOCK_SIZE / 4)
+
+// Generations tell apart arenas reusing the same address
+static std::atomic<uint64_t> next_gen = 1;
+
+// Per thread allocation state of the current arena
+struct arena::local {
+    uint64_t gen = 0;
+    char *cur = nullptr;
+    char *end = nullptr;
+
+    // Open addressing table of names interned on this thread, lives in the arena
+    std::string_view *names = nullptr;
+    size_t mask = 0;
+    size_t count = 0;
+};
+
+static char *align_up(char *p, size_t align) {
+    return reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~(align - 1));
+}
+
+static size_t hash_name(std::string_view s) {
+    size_t h = 0xcbf29ce484222325ULL;
+    for (char c: s) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+arena::arena() : prev(_current), gen(next_gen++) {
+    _current = this;
+}
+
+arena::~arena() {
+    for (auto b: blocks)
+        free(b);
+    _current = prev;
+}
+
+arena::local &arena::get_local() {
+    static thread_local local l;
+    if (l.gen != gen)
+        l = local{.gen = gen};
+    return l;
+}
+
+char *arena::new_block(size_t size) {
+    auto b = static_cast<char *>(malloc(size));
+    std::lock_guard g(lock);
+    blocks.push_back(b);
+    total.blocks++;
+    total.bytes += size;
+    return b;
+}
+
+void *arena::alloc(size_t size, size_t align) {
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    if (size + align > LARGE_SIZE)
+        return align_up(new_block(size + align), align);
+
+    auto &l = get_local();
+    char *p = align_up(l.cur, align);
+    if (!l.cur || p + size > l.end) {
+        l.cur = new_block(BLOCK_SIZE);
+        l.end = l.cur + BLOCK_SIZE;
+        p = align_up(l.cur, align);
+    }
+    l.cur = p + size;
+    return p;
+}
+
+std::string_view arena::intern(std::string_view s) {
+    auto &l = get_local();
+    if (l.count * 2 >= l.mask) {
+        // Grow the table, the old one is simply abandoned
+        size_t cap = l.names ? (l.mask + 1) * 2 : 256;
+        auto table = static_cast<std::string_view *>(alloc(cap * sizeof(std::string_view),
+                                                          alignof(std::string_view)));
+        std::uninitialized_fill_n(table, cap, std::string_view());
+        for (size_t i = 0; l.names && i <= l.mask; ++i) {
+            if (!l.names[i].data())
+                continue;
+            size_t j = hash_name(l.names[i]) & (cap - 1);
+            while (table[j].data())
+                j = (j + 1) & (cap - 1);
+            table[j] = l.names[i];
+        }
+        l.names = table;
+        l.mask = cap - 1;
+    }
+
+    size_t i = hash_name(s) & l.mask;
+    for (; l.names[i].data(); i = (i + 1) & l.mask) {
+        if (l.names[i] == s) {
+            interned.fetch_add(1, std::memory_order_relaxed);
+            return l.names[i];
+        }
+    }
+    auto p = static_cast<char *>(alloc(s.size() + 1, 1));
+    memcpy(p, s.data(), s.size());
+    p[s.size()] = '\0';
+    l.names[i] = {p, s.size()};
+    l.count++;
+    names.fetch_add(1, std::memory_order_relaxed);
+    return l.names[i];
+}
+
+arena::stats arena::get_stats() {
+    std::lock_guard g(lock);
+    auto st = total;
+    st.allocs = allocs;
+    st.names = names;
+    st.interned = interned;
+    return st;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+// Bump allocator for everything owned by the node tree of a single run.
+//
+// Memory is handed out from large blocks and only released all at once when
+// the arena is destroyed, destructors of the allocated objects are never run.
+// Each thread bumps its own block, so allocating from worker threads only takes
+// the lock when a new block is needed.
+class arena {
+public:
+    struct stats {
+        size_t allocs;
+        size_t bytes;
+        size_t blocks;
+        size_t names;
+        size_t interned;
+    };
+
+    // Construct an arena and make it the current one
+    arena();
+
+    // Release all memory and restore the previously current arena
+    ~arena();
+
+    arena(const arena &) = delete;
+
+    static arena *current() { return _current; }
+
+    void *alloc(size_t size, size_t align = alignof(std::max_align_t));
+
+    // Return a null terminated copy of s owned by the arena.
+    // Equal strings allocated on the same thread share the same copy.
+    std::string_view intern(std::string_view s);
+
+    stats get_stats();
+
+private:
+    struct local;
+
+    local &get_local();
+
+    char *new_block(size_t size);
+
+    static inline arena *_current = nullptr;
+
+    arena *prev;
+    const uint64_t gen;
+    std::mutex lock;
+    std::vector<void *> blocks;
+    stats total{};
+    std::atomic_size_t allocs = 0;
+    std::atomic_size_t names = 0;
+    std::atomic_size_t interned = 0;
+};
+
+// STL allocator backed by the current arena, deallocation is a no-op
+template<class T>
+struct arena_allocator {
+    using value_type = T;
+
+    arena_allocator() = default;
+
+    template<class U>
+    arena_allocator(const arena_allocator<U> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(arena::current()->alloc(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *, size_t) {}
+
+    template<class U>
+    bool operator==(const arena_allocator<U> &) const { return true; }
+};
@@ -2,31 +2,56 @@
 #include <sys/xattr.h>
 #include <sys/syscall.h>
 #include <sys/sendfile.h>
+#include <sys/ioctl.h>
 #include <sys/sysmacros.h>
+#include <sched.h>
+#include <climits>
+#include <mutex>
 
 #include "base.hpp"
 #include "logging.h"
+#include "stats.hpp"
 
 using namespace std::string_view_literals;
 
-struct dirent *xreaddir(DIR *dirp) {
-    errno = 0;
-    for (dirent *e;;) {
-        e = readdir(dirp);
-        if (e == nullptr) {
-            if (errno)
-                PLOGE("readdir");
-            return nullptr;
-        } else if (e->d_name == "."sv || e->d_name == ".."sv) {
-            // Filter . and .. for users
-            continue;
-        }
-        return e;
+#define DIR_BUF_SIZE  (32 * 1024)
+
+// Free buffers of dir_reader on this thread
+static thread_local std::vector<std::unique_ptr<char[]>> dir_bufs;
+
+dir_reader::dir_reader(int fd) : _fd(fd) {
+    if (dir_bufs.empty()) {
+        buf = new char[DIR_BUF_SIZE];
+    } else {
+        buf = dir_bufs.back().release();
+        dir_bufs.pop_back();
+    }
+}
+
+dir_reader::~dir_reader() {
+    if (_fd >= 0)
+        close(_fd);
+    dir_bufs.emplace_back(buf);
+}
+
+bool dir_reader::read() {
+    len = 0;
+    if (_fd < 0)
+        return false;
+    long n;
+    do {
+        n = count_call(STAT_GETDENTS, [&] { return syscall(__NR_getdents64, _fd, buf, DIR_BUF_SIZE); });
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        PLOGE("getdents64");
+        return false;
     }
+    len = n;
+    return n > 0;
 }
 
 sDIR make_dir(DIR *dp) {
-    return sDIR(dp, [](DIR *dp) { return dp ? closedir(dp) : 1; });
+    return sDIR(dp);
 }
 
 sFILE make_file(FILE *fp) {
@@ -36,57 +61,276 @@ sFILE make_file(FILE *fp) {
 int xmount(const char *source, const char *target,
            const char *filesystemtype, unsigned long mountflags,
            const void *data) {
-    int ret = mount(source, target, filesystemtype, mountflags, data);
+    int ret = count_call(STAT_MOUNT, [&] { return mount(source, target, filesystemtype, mountflags, data); });
     if (ret < 0) {
         PLOGE("mount %s->%s", source, target);
     }
     return ret;
 }
 
+// The new mount API may be missing from libc headers
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+
+// struct mount_attr, named differently to not clash with libc
+struct mount_attr_args {
+    uint64_t attr_set;
+    uint64_t attr_clr;
+    uint64_t propagation;
+    uint64_t userns_fd;
+};
+
+int xattach_tree(const char *source, const char *target) {
+    static std::atomic_bool no_mount_api = false;
+    if (no_mount_api.load(std::memory_order_relaxed)) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    const char *op = "open_tree";
+    int ret = -1;
+    int fd = count_call(STAT_MOUNT, [&] {
+        return syscall(__NR_open_tree, AT_FDCWD, source, OPEN_TREE_CLONE | AT_RECURSIVE | O_CLOEXEC);
+    });
+    if (fd >= 0) {
+        mount_attr_args attr{.propagation = MS_PRIVATE};
+        op = "mount_setattr";
+        ret = count_call(STAT_MOUNT, [&] {
+            return syscall(__NR_mount_setattr, fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr));
+        });
+        if (ret == 0) {
+            op = "move_mount";
+            ret = count_call(STAT_MOUNT, [&] {
+                return syscall(__NR_move_mount, fd, "", AT_FDCWD, target, MOVE_MOUNT_F_EMPTY_PATH);
+            });
+        }
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    if (ret < 0) {
+        if (errno == ENOSYS) {
+            LOGI("%s is not supported, fall back to mount", op);
+            no_mount_api = true;
+        } else {
+            PLOGE("%s %s->%s", op, source, target);
+        }
+    }
+    return ret;
+}
+
+void task_pool::spawn(std::function<void()> fn) {
+    pending.fetch_add(1, std::memory_order_relaxed);
+    {
+        auto &q = queues[current < queues.size() ? current : 0];
+        std::lock_guard g(q.lock);
+        q.tasks.push_back(std::move(fn));
+    }
+    queued.fetch_add(1);
+    // Taken so a thread about to wait sees the task
+    std::lock_guard g(idle_lock);
+    idle.notify_one();
+}
+
+bool task_pool::next(size_t self, std::function<void()> &fn) {
+    for (size_t i = 0; i < queues.size(); ++i) {
+        auto &q = queues[(self + i) % queues.size()];
+        std::lock_guard g(q.lock);
+        if (q.tasks.empty())
+            continue;
+        if (i == 0) {
+            fn = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {
+            fn = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        queued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+void task_pool::worker(size_t self) {
+    current = self;
+    std::function<void()> fn;
+    for (;;) {
+        if (next(self, fn)) {
+            fn();
+            fn = nullptr;
+            if (pending.fetch_sub(1) == 1) {
+                std::lock_guard g(idle_lock);
+                idle.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock l(idle_lock);
+        idle.wait(l, [&] { return pending == 0 || queued > 0; });
+        if (pending == 0)
+            break;
+    }
+    current = 0;
+}
+
+void task_pool::run() {
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < queues.size(); ++t)
+        threads.emplace_back([this, t] { worker(t); });
+    worker(0);
+    for (auto &t: threads)
+        t.join();
+}
+
+int open_under_mounts(const char *path) {
+    return syscall(__NR_open_tree, AT_FDCWD, path, OPEN_TREE_CLONE | O_CLOEXEC);
+}
+
+int enter_mount_ns(int pid) {
+    static bool no_pidfd_setns = false;
+    if (!no_pidfd_setns) {
+        int fd = syscall(__NR_pidfd_open, pid, 0);
+        if (fd >= 0) {
+            int ret = setns(fd, CLONE_NEWNS);
+            int saved = errno;
+            close(fd);
+            if (ret == 0)
+                return 0;
+            errno = saved;
+        }
+        if (errno != ENOSYS && errno != EINVAL) {
+            PLOGE("enter mount ns of %d", pid);
+            return -1;
+        }
+        no_pidfd_setns = true;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "/proc/%d/ns/mnt", pid);
+    int fd = open(buf, O_RDONLY | O_CLOEXEC);
+    int ret = fd < 0 ? -1 : setns(fd, CLONE_NEWNS);
+    if (ret != 0)
+        PLOGE("enter mount ns of %d", pid);
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
+
+bool parse_pids(std::string_view list, std::vector<int> &pids) {
+    while (!list.empty()) {
+        auto pos = list.find(',');
+        auto item = list.substr(0, pos);
+        int pid = 0;
+        for (char c: item) {
+            if (c < '0' || c > '9' || pid > (INT_MAX - (c - '0')) / 10)
+                return false;
+            pid = pid * 10 + (c - '0');
+        }
+        if (pid <= 0)
+            return false;
+        pids.push_back(pid);
+        list = pos == std::string_view::npos ? std::string_view() : list.substr(pos + 1);
+    }
+    return true;
+}
+
 
 struct file_attr {
     struct stat st;
-    char con[128];
+    // Interned SELinux context, null if the file has none
+    const char *con;
 };
 
-static void freecon(char *s) {
-    free(s);
+static struct {
+    std::atomic_size_t chmod, chown, setcon;
+    std::atomic_size_t skip_chmod, skip_chown, skip_setcon;
+    std::atomic_size_t reads;
+    std::atomic_size_t contexts;
+} attr_counters;
+
+// Files only carry a handful of distinct SELinux contexts. Interning them
+// saves an allocation per file and lets contexts be compared by pointer.
+static const char *intern_con(const char *con) {
+    static thread_local const char *last = nullptr;
+    if (last && strcmp(last, con) == 0)
+        return last;
+
+    static std::mutex lock;
+    static std::vector<std::unique_ptr<char[]>> cons;
+    std::lock_guard g(lock);
+    for (auto &c: cons) {
+        if (strcmp(c.get(), con) == 0)
+            return last = c.get();
+    }
+    size_t len = strlen(con) + 1;
+    auto &c = cons.emplace_back(new char[len]);
+    memcpy(c.get(), con, len);
+    attr_counters.contexts++;
+    return last = c.get();
 }
 
-static int getfilecon(const char *path, char **ctx) {
-    char buf[1024];
-    int rc = syscall(__NR_getxattr, path, XATTR_NAME_SELINUX, buf, sizeof(buf) - 1);
-    if (rc >= 0)
-        *ctx = strdup(buf);
-    return rc;
+// A file without a context is not an error
+static int to_con(char *buf, ssize_t rc, const char **con) {
+    *con = nullptr;
+    if (rc < 0)
+        return errno == ENODATA || errno == ENOTSUP ? 0 : -1;
+    buf[rc] = '\0';
+    if (buf[0])
+        *con = intern_con(buf);
+    return 0;
 }
 
-static int lgetfilecon(const char *path, char **ctx) {
+static int lgetfilecon(const char *path, const char **con) {
     char buf[1024];
-    int rc = syscall(__NR_lgetxattr, path, XATTR_NAME_SELINUX, buf, sizeof(buf) - 1);
-    if (rc >= 0)
-        *ctx = strdup(buf);
-    return rc;
+    ssize_t rc = count_call(STAT_GETXATTR, [&] {
+        return syscall(__NR_lgetxattr, path, XATTR_NAME_SELINUX, buf, sizeof(buf) - 1);
+    });
+    return to_con(buf, rc, con);
 }
 
-static int fgetfilecon(int fd, char **ctx) {
+static int fgetfilecon(int fd, const char **con) {
     char buf[1024];
-    int rc = syscall(__NR_fgetxattr, fd, XATTR_NAME_SELINUX, buf, sizeof(buf) - 1);
-    if (rc >= 0)
-        *ctx = strdup(buf);
-    return rc;
+    ssize_t rc = count_call(STAT_GETXATTR, [&] {
+        return syscall(__NR_fgetxattr, fd, XATTR_NAME_SELINUX, buf, sizeof(buf) - 1);
+    });
+    return to_con(buf, rc, con);
 }
 
-static int setfilecon(const char *path, const char *ctx) {
-    return syscall(__NR_setxattr, path, XATTR_NAME_SELINUX, ctx, strlen(ctx) + 1, 0);
+int get_con(const char *path, const char **con) {
+    return lgetfilecon(path, con);
+}
+
+int get_con(int fd, const char **con) {
+    return fgetfilecon(fd, con);
 }
 
 static int lsetfilecon(const char *path, const char *ctx) {
-    return syscall(__NR_lsetxattr, path, XATTR_NAME_SELINUX, ctx, strlen(ctx) + 1, 0);
+    return count_call(STAT_SETXATTR, [&] {
+        return syscall(__NR_lsetxattr, path, XATTR_NAME_SELINUX, ctx, strlen(ctx) + 1, 0);
+    });
 }
 
 static int fsetfilecon(int fd, const char *ctx) {
-    return syscall(__NR_fsetxattr, fd, XATTR_NAME_SELINUX, ctx, strlen(ctx) + 1, 0);
+    return count_call(STAT_SETXATTR, [&] {
+        return syscall(__NR_fsetxattr, fd, XATTR_NAME_SELINUX, ctx, strlen(ctx) + 1, 0);
+    });
 }
 
 ssize_t fd_path(int fd, char *path, size_t size) {
@@ -106,12 +350,7 @@ int fd_pathat(int dirfd, const char *name, char *path, size_t size) {
 int getattr(const char *path, file_attr *a) {
     if (xlstat(path, &a->st) == -1)
         return -1;
-    char *con;
-    if (lgetfilecon(path, &con) == -1)
-        return -1;
-    strcpy(a->con, con);
-    freecon(con);
-    return 0;
+    return lgetfilecon(path, &a->con);
 }
 
 int getattrat(int dirfd, const char *name, file_attr *a) {
@@ -123,51 +362,170 @@ int getattrat(int dirfd, const char *name, file_attr *a) {
 int fgetattr(int fd, file_attr *a) {
     if (xfstat(fd, &a->st) < 0)
         return -1;
-    char *con;
-    if (fgetfilecon(fd, &con) < 0)
-        return -1;
-    strcpy(a->con, con);
-    freecon(con);
-    return 0;
+    return fgetfilecon(fd, &a->con);
 }
 
+// Attributes of a file just created by us with mode 0
+static file_attr new_attr() {
+    file_attr a{};
+    a.st.st_uid = geteuid();
+    a.st.st_gid = getegid();
+    return a;
+}
 
-int setattr(const char *path, file_attr *a) {
-    if (chmod(path, a->st.st_mode & 0777) < 0)
-        return -1;
-    if (chown(path, a->st.st_uid, a->st.st_gid) < 0)
-        return -1;
-    if (a->con[0] && lsetfilecon(path, a->con) < 0)
-        return -1;
+// Apply a with the given setters. If cur holds the current attributes
+// of the target, only the ones that differ are written.
+template<class Chmod, class Chown, class Setcon>
+static int apply_attr(const file_attr *a, const file_attr *cur,
+                      const Chmod &do_chmod, const Chown &do_chown, const Setcon &do_setcon) {
+    mode_t mode = a->st.st_mode & 0777;
+    if (cur && (cur->st.st_mode & 0777) == mode) {
+        attr_counters.skip_chmod++;
+    } else {
+        attr_counters.chmod++;
+        if (do_chmod(mode) < 0)
+            return -1;
+    }
+    if (cur && cur->st.st_uid == a->st.st_uid && cur->st.st_gid == a->st.st_gid) {
+        attr_counters.skip_chown++;
+    } else {
+        attr_counters.chown++;
+        if (do_chown(a->st.st_uid, a->st.st_gid) < 0)
+            return -1;
+    }
+    if (a->con) {
+        if (cur && cur->con == a->con) {
+            attr_counters.skip_setcon++;
+        } else {
+            attr_counters.setcon++;
+            if (do_setcon(a->con) < 0)
+                return -1;
+        }
+    }
     return 0;
 }
 
-int setattrat(int dirfd, const char *name, file_attr *a) {
+int setattr(const char *path, const file_attr *a, const file_attr *cur = nullptr) {
+    return apply_attr(a, cur,
+                      [=](mode_t mode) { return count_call(STAT_CHMOD, [=] { return chmod(path, mode); }); },
+                      [=](uid_t uid, gid_t gid) { return count_call(STAT_CHOWN, [=] { return chown(path, uid, gid); }); },
+                      [=](const char *con) { return lsetfilecon(path, con); });
+}
+
+int setattrat(int dirfd, const char *name, const file_attr *a) {
     char path[4096];
     fd_pathat(dirfd, name, path, sizeof(path));
     return setattr(path, a);
 }
 
-int fsetattr(int fd, file_attr *a) {
-    if (fchmod(fd, a->st.st_mode & 0777) < 0)
-        return -1;
-    if (fchown(fd, a->st.st_uid, a->st.st_gid) < 0)
-        return -1;
-    if (a->con[0] && fsetfilecon(fd, a->con) < 0)
-        return -1;
-    return 0;
+int fsetattr(int fd, const file_attr *a, const file_attr *cur = nullptr) {
+    return apply_attr(a, cur,
+                      [=](mode_t mode) { return count_call(STAT_CHMOD, [=] { return fchmod(fd, mode); }); },
+                      [=](uid_t uid, gid_t gid) { return count_call(STAT_CHOWN, [=] { return fchown(fd, uid, gid); }); },
+                      [=](const char *con) { return fsetfilecon(fd, con); });
 }
 
-void clone_attr(const char *src, const char *dest) {
+void clone_attr(const char *src, const char *dest, bool fresh) {
     file_attr a;
-    getattr(src, &a);
-    setattr(dest, &a);
+    if (getattr(src, &a) < 0)
+        return;
+    file_attr cur;
+    if (fresh) {
+        cur = new_attr();
+        setattr(dest, &a, &cur);
+    } else {
+        // Reading back is cheaper than rewriting, which dirties the inode
+        attr_counters.reads += 2;
+        bool read = count_call(STAT_LSTAT, [&] { return lstat(dest, &cur.st); }) == 0 &&
+                    lgetfilecon(dest, &cur.con) == 0;
+        setattr(dest, &a, read ? &cur : nullptr);
+    }
+}
+
+bool same_attr(const char *src, const char *dest) {
+    file_attr a, cur;
+    if (getattr(src, &a) < 0 || getattr(dest, &cur) < 0)
+        return false;
+    // Only the permission bits are copied, and no context if src has none
+    return (cur.st.st_mode & 07777) == (a.st.st_mode & 0777) &&
+           cur.st.st_uid == a.st.st_uid && cur.st.st_gid == a.st.st_gid &&
+           (!a.con || cur.con == a.con);
 }
 
 void fclone_attr(int src, int dest) {
     file_attr a;
-    fgetattr(src, &a);
-    fsetattr(dest, &a);
+    if (fgetattr(src, &a) == 0)
+        fsetattr(dest, &a);
+}
+
+attr_stats get_attr_stats() {
+    return {
+            .chmod = attr_counters.chmod,
+            .chown = attr_counters.chown,
+            .setcon = attr_counters.setcon,
+            .skip_chmod = attr_counters.skip_chmod,
+            .skip_chown = attr_counters.skip_chown,
+            .skip_setcon = attr_counters.skip_setcon,
+            .reads = attr_counters.reads,
+            .contexts = attr_counters.contexts,
+    };
+}
+
+int fstatat_type(int dirfd, const char *name, mode_t *mode) {
+    static std::atomic_bool no_statx = false;
+    if (!no_statx.load(std::memory_order_relaxed)) {
+        struct statx stx{};
+        int ret = count_call(STAT_LSTAT, [&] {
+            return syscall(__NR_statx, dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                           STATX_TYPE, &stx);
+        });
+        if (ret == 0) {
+            *mode = stx.stx_mode;
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return ret;
+        no_statx = true;
+    }
+    struct stat st{};
+    if (count_call(STAT_LSTAT, [&] { return fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW); }) != 0)
+        return -1;
+    *mode = st.st_mode;
+    return 0;
+}
+
+#ifndef STATX_MNT_ID
+#define STATX_MNT_ID 0x1000U
+#endif
+
+// stx_mnt_id, which older libc headers leave in the padding
+#define STATX_MNT_ID_OFFSET 144
+static_assert(sizeof(struct statx) >= STATX_MNT_ID_OFFSET + sizeof(uint64_t));
+
+int stat_mount(const char *path, struct stat *st, uint64_t *mnt_id) {
+    static std::atomic_bool no_statx = false;
+    *mnt_id = 0;
+    if (!no_statx.load(std::memory_order_relaxed)) {
+        struct statx stx{};
+        int ret = count_call(STAT_LSTAT, [&] {
+            return syscall(__NR_statx, AT_FDCWD, path, 0, STATX_BASIC_STATS | STATX_MNT_ID, &stx);
+        });
+        if (ret == 0) {
+            *st = {};
+            st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            st->st_ino = stx.stx_ino;
+            st->st_mode = stx.stx_mode;
+            st->st_uid = stx.stx_uid;
+            st->st_gid = stx.stx_gid;
+            if (stx.stx_mask & STATX_MNT_ID)
+                memcpy(mnt_id, reinterpret_cast<char *>(&stx) + STATX_MNT_ID_OFFSET, sizeof(*mnt_id));
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return ret;
+        no_statx = true;
+    }
+    return count_call(STAT_LSTAT, [&] { return stat(path, st); });
 }
 
 // https://github.com/topjohnwu/Magisk/blob/66a7ef5615f463435b45d29e737d37cf48a9b78c/native/src/base/files.cpp#L26
@@ -179,7 +537,7 @@ int mkdirs(const char *path, mode_t mode) {
     for (char *p = &buf[1]; *p; ++p) {
         if (*p == '/') {
             *p = '\0';
-            if (mkdir(buf, mode) == -1) {
+            if (count_call(STAT_MKDIR, [&] { return mkdir(buf, mode); }) == -1) {
                 if (errno != EEXIST) {
                     PLOGE("mkdir %s", buf);
                     return -1;
@@ -188,7 +546,7 @@ int mkdirs(const char *path, mode_t mode) {
             *p = '/';
         }
     }
-    if (mkdir(buf, mode) == -1) {
+    if (count_call(STAT_MKDIR, [&] { return mkdir(buf, mode); }) == -1) {
         if (errno != EEXIST) {
             PLOGE("mkdir %s", buf);
             return -1;
@@ -208,62 +566,228 @@ int xmkdirs(const char *pathname, mode_t mode) {
 // https://github.com/topjohnwu/Magisk/blob/40aab136019f4c1950f0789baf92a0686cd0a29e/native/src/base/files.cpp#L144
 
 
-void clone_dir(int src, int dest) {
-    auto dir = xopen_dir(src);
-    run_finally f([&] { close(dest); });
-    for (dirent *entry; (entry = xreaddir(dir.get()));) {
-        file_attr a;
-        getattrat(src, entry->d_name, &a);
-        switch (entry->d_type) {
-            case DT_DIR: {
-                xmkdirat(dest, entry->d_name, 0);
-                setattrat(dest, entry->d_name, &a);
-                int sfd = xopenat(src, entry->d_name, O_RDONLY | O_CLOEXEC);
-                int dst = xopenat(dest, entry->d_name, O_RDONLY | O_CLOEXEC);
-                clone_dir(sfd, dst);
-                break;
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+enum copy_tier : uint8_t {
+    COPY_CLONE,
+    COPY_RANGE,
+    COPY_SENDFILE,
+};
+
+// The cheapest copy method known to work between two filesystems
+struct copy_pair {
+    dev_t src;
+    dev_t dest;
+    copy_tier tier;
+};
+
+static std::mutex copy_lock;
+static std::vector<copy_pair> copy_tiers;
+
+static copy_tier get_copy_tier(dev_t src, dev_t dest) {
+    std::lock_guard g(copy_lock);
+    for (auto &p: copy_tiers) {
+        if (p.src == src && p.dest == dest)
+            return p.tier;
+    }
+    return COPY_CLONE;
+}
+
+static void set_copy_tier(dev_t src, dev_t dest, copy_tier tier) {
+    std::lock_guard g(copy_lock);
+    for (auto &p: copy_tiers) {
+        if (p.src == src && p.dest == dest) {
+            p.tier = std::max(p.tier, tier);
+            return;
+        }
+    }
+    copy_tiers.push_back({src, dest, tier});
+}
+
+int copy_data(int sfd, int dfd, size_t size, dev_t sdev, dev_t ddev) {
+    auto tier = get_copy_tier(sdev, ddev);
+    if (tier == COPY_CLONE) {
+        // Share the extents if both files are on the same reflink capable filesystem
+        if (count_call(STAT_CLONE, [&] { return ioctl(dfd, FICLONE, sfd); }) == 0)
+            return 0;
+        tier = COPY_RANGE;
+        set_copy_tier(sdev, ddev, tier);
+    }
+
+    loff_t off = 0;
+    const auto len = static_cast<loff_t>(size);
+    if (tier == COPY_RANGE) {
+        // Copied in kernel, possibly offloaded to the filesystem
+        while (off < len) {
+            loff_t in = off, out = off;
+            ssize_t n = count_call(STAT_COPY_RANGE, [&] {
+                return syscall(__NR_copy_file_range, sfd, &in, dfd, &out, len - off, 0);
+            });
+            if (n == 0 && off > 0) {
+                // Source got shorter, the copy is truncated
+                errno = EIO;
+                PLOGE("copy_file_range");
+                return -1;
             }
-            case DT_REG: {
-                int sfd = xopenat(src, entry->d_name, O_RDONLY | O_CLOEXEC);
-                int dfd = xopenat(dest, entry->d_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0);
-                xsendfile(dfd, sfd, nullptr, a.st.st_size);
-                fsetattr(dfd, &a);
-                close(dfd);
-                close(sfd);
-                break;
+            if (n <= 0) {
+                // Some filesystems copy nothing instead of failing
+                if (off == 0 && (n == 0 || errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                                 errno == EOPNOTSUPP)) {
+                    set_copy_tier(sdev, ddev, COPY_SENDFILE);
+                    break;
+                }
+                PLOGE("copy_file_range");
+                return -1;
             }
-            case DT_LNK: {
-                char buf[4096];
-                xreadlinkat(src, entry->d_name, buf, sizeof(buf));
-                xsymlinkat(buf, dest, entry->d_name);
-                setattrat(dest, entry->d_name, &a);
-                break;
+            off += n;
+        }
+        if (off == len)
+            return 0;
+    }
+
+    // sendfile writes at the current offset of dfd, which is still 0. Its offset
+    // is an off_t, only 32 bits on 32-bit bionic, so sendfile64 takes one of its own
+    off64_t pos = off;
+    while (pos < len) {
+        ssize_t n = count_call(STAT_SENDFILE, [&] { return sendfile64(dfd, sfd, &pos, len - pos); });
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            PLOGE("sendfile");
+            return -1;
+        }
+        if (n == 0) {
+            // Source got shorter, the copy is truncated
+            errno = EIO;
+            PLOGE("sendfile");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Regular files found by clone_dir, copied in batches to bound the number of open fds
+class copy_queue {
+    DISALLOW_COPY_AND_MOVE(copy_queue)
+
+    struct job {
+        int sfd;
+        int dfd;
+        file_attr a;
+    };
+
+public:
+    copy_queue(dev_t dest, int jobs) : dest(dest), jobs(jobs) {}
+
+    ~copy_queue() { flush(); }
+
+    void add(int sfd, int dfd, const file_attr &a) {
+        queue.push_back({sfd, dfd, a});
+        if (queue.size() >= 256)
+            flush();
+    }
+
+    void flush() {
+        // Threads only pay off with enough files to copy
+        const file_attr fresh = new_attr();
+        parallel_for(queue.size(), queue.size() >= 16 ? jobs : 1, [&](size_t i) {
+            auto &j = queue[i];
+            copy_data(j.sfd, j.dfd, j.a.st.st_size, j.a.st.st_dev, dest);
+            fsetattr(j.dfd, &j.a, &fresh);
+            close(j.dfd);
+            close(j.sfd);
+        });
+        queue.clear();
+    }
+
+private:
+    const dev_t dest;
+    const int jobs;
+    std::vector<job> queue;
+};
+
+static void clone_dir(int src, int dest, copy_queue &files) {
+    dir_reader dir(src);
+    run_finally f([&] { close(dest); });
+    const file_attr fresh = new_attr();
+    while (dir.read()) {
+        for (auto entry: dir) {
+            const char *name = entry.name.data();
+            file_attr a{};
+            switch (entry.type) {
+                case DT_DIR: {
+                    int sfd = xopenat(src, name, O_RDONLY | O_CLOEXEC);
+                    if (sfd < 0 || fgetattr(sfd, &a) < 0) {
+                        close(sfd);
+                        break;
+                    }
+                    xmkdirat(dest, name, 0);
+                    int dst = xopenat(dest, name, O_RDONLY | O_CLOEXEC);
+                    if (dst < 0) {
+                        close(sfd);
+                        break;
+                    }
+                    fsetattr(dst, &a, &fresh);
+                    clone_dir(sfd, dst, files);
+                    break;
+                }
+                case DT_REG: {
+                    int sfd = xopenat(src, name, O_RDONLY | O_CLOEXEC);
+                    int dfd = xopenat(dest, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0);
+                    if (sfd < 0 || dfd < 0 || fgetattr(sfd, &a) < 0) {
+                        close(sfd);
+                        close(dfd);
+                        break;
+                    }
+                    files.add(sfd, dfd, a);
+                    break;
+                }
+                case DT_LNK: {
+                    char buf[4096];
+                    if (getattrat(src, name, &a) < 0 || xreadlinkat(src, name, buf, sizeof(buf)) < 0)
+                        break;
+                    xsymlinkat(buf, dest, name);
+                    setattrat(dest, name, &a);
+                    break;
+                }
             }
         }
     }
 }
 
-void cp_afc(const char *src, const char *dest) {
+void cp_afc(const char *src, const char *dest, int jobs) {
     file_attr a;
-    getattr(src, &a);
+    if (getattr(src, &a) < 0)
+        return;
+    const file_attr fresh = new_attr();
     if (S_ISDIR(a.st.st_mode)) {
         xmkdirs(dest, 0);
-        clone_dir(xopen(src, O_RDONLY | O_CLOEXEC), xopen(dest, O_RDONLY | O_CLOEXEC));
+        int dfd = xopen(dest, O_RDONLY | O_CLOEXEC);
+        struct stat st{};
+        fstat(dfd, &st);
+        copy_queue files(st.st_dev, jobs);
+        clone_dir(xopen(src, O_RDONLY | O_CLOEXEC), dfd, files);
+        setattr(dest, &a, &fresh);
     } else {
         unlink(dest);
         if (S_ISREG(a.st.st_mode)) {
             int sfd = xopen(src, O_RDONLY | O_CLOEXEC);
             int dfd = xopen(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0);
-            xsendfile(dfd, sfd, nullptr, a.st.st_size);
+            struct stat st{};
+            fstat(dfd, &st);
+            copy_data(sfd, dfd, a.st.st_size, a.st.st_dev, st.st_dev);
+            fsetattr(dfd, &a, &fresh);
             close(sfd);
             close(dfd);
         } else if (S_ISLNK(a.st.st_mode)) {
             char buf[4096];
             xreadlink(src, buf, sizeof(buf));
             xsymlink(buf, dest);
+            setattr(dest, &a);
         }
     }
-    setattr(dest, &a);
 }
 
 void file_readline(bool trim, FILE *fp, const std::function<bool(std::string_view)> &fn) {
@@ -370,17 +894,17 @@ std::vector<mount_info> parse_mount_info(const char *pid) {
                 .id = id,
                 .parent = parent,
                 .device = static_cast<dev_t>(makedev(maj, min)),
-                .root {root},
-                .target {target},
-                .vfs_option {vfs_option},
+                .root = std::string(root),
+                .target = std::string(target),
+                .vfs_option = std::string(vfs_option),
                 .optional {
                         .shared = shared,
                         .master = master,
                         .propagate_from = propagate_from,
                 },
-                .type {type},
-                .source {source},
-                .fs_option {fs_option},
+                .type = std::string(type),
+                .source = std::string(source),
+                .fs_option = std::string(fs_option),
         });
         return true;
     });
@@ -388,7 +912,7 @@ std::vector<mount_info> parse_mount_info(const char *pid) {
 }
 
 int xsymlink(const char *target, const char *linkpath) {
-    int ret = symlink(target, linkpath);
+    int ret = count_call(STAT_SYMLINK, [&] { return symlink(target, linkpath); });
     if (ret < 0) {
         PLOGE("symlink %s->%s", target, linkpath);
     }
@@ -396,7 +920,7 @@ int xsymlink(const char *target, const char *linkpath) {
 }
 
 ssize_t xreadlink(const char *pathname, char *buf, size_t bufsiz) {
-    ssize_t ret = readlink(pathname, buf, bufsiz);
+    ssize_t ret = count_call(STAT_READLINK, [&] { return readlink(pathname, buf, bufsiz); });
     if (ret < 0) {
         PLOGE("readlink %s", pathname);
     } else {
@@ -410,13 +934,13 @@ ssize_t xreadlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz) {
     // instead of number of bytes placed in buf (length of link)
 #if defined(__i386__) || defined(__x86_64__)
     memset(buf, 0, bufsiz);
-    ssize_t ret = readlinkat(dirfd, pathname, buf, bufsiz);
+    ssize_t ret = count_call(STAT_READLINK, [&] { return readlinkat(dirfd, pathname, buf, bufsiz); });
     if (ret < 0) {
         PLOGE("readlinkat %s", pathname);
     }
     return ret;
 #else
-    ssize_t ret = readlinkat(dirfd, pathname, buf, bufsiz);
+    ssize_t ret = count_call(STAT_READLINK, [&] { return readlinkat(dirfd, pathname, buf, bufsiz); });
     if (ret < 0) {
         PLOGE("readlinkat %s", pathname);
     } else {
@@ -428,15 +952,34 @@ ssize_t xreadlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz) {
 
 
 int xsymlinkat(const char *target, int newdirfd, const char *linkpath) {
-    int ret = symlinkat(target, newdirfd, linkpath);
+    int ret = count_call(STAT_SYMLINK, [&] { return symlinkat(target, newdirfd, linkpath); });
     if (ret < 0) {
         PLOGE("symlinkat %s->%s", target, linkpath);
     }
     return ret;
 }
 
+ssize_t xwrite(int fd, const void *buf, size_t count) {
+    size_t write_sz = 0;
+    ssize_t ret;
+    do {
+        ret = write(fd, static_cast<const char *>(buf) + write_sz, count - write_sz);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            PLOGE("write");
+            return ret;
+        }
+        write_sz += ret;
+    } while (write_sz != count && ret != 0);
+    if (write_sz != count) {
+        PLOGE("write (%zu != %zu)", count, write_sz);
+    }
+    return write_sz;
+}
+
 ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
-    ssize_t ret = sendfile(out_fd, in_fd, offset, count);
+    ssize_t ret = count_call(STAT_SENDFILE, [&] { return sendfile(out_fd, in_fd, offset, count); });
     if (ret < 0) {
         PLOGE("sendfile");
     }
@@ -444,7 +987,7 @@ ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
 }
 
 int xlstat(const char *pathname, struct stat *buf) {
-    int ret = lstat(pathname, buf);
+    int ret = count_call(STAT_LSTAT, [&] { return lstat(pathname, buf); });
     if (ret < 0) {
         PLOGE("lstat %s", pathname);
     }
@@ -452,7 +995,7 @@ int xlstat(const char *pathname, struct stat *buf) {
 }
 
 int xfstat(int fd, struct stat *buf) {
-    int ret = fstat(fd, buf);
+    int ret = count_call(STAT_LSTAT, [&] { return fstat(fd, buf); });
     if (ret < 0) {
         PLOGE("fstat %d", fd);
     }
@@ -460,7 +1003,7 @@ int xfstat(int fd, struct stat *buf) {
 }
 
 int xmkdirat(int dirfd, const char *pathname, mode_t mode) {
-    int ret = mkdirat(dirfd, pathname, mode);
+    int ret = count_call(STAT_MKDIR, [&] { return mkdirat(dirfd, pathname, mode); });
     if (ret < 0 && errno != EEXIST) {
         PLOGE("mkdirat %s %u", pathname, mode);
     }
@@ -468,7 +1011,7 @@ int xmkdirat(int dirfd, const char *pathname, mode_t mode) {
 }
 
 int xmkdir(const char *pathname, mode_t mode) {
-    int ret = mkdir(pathname, mode);
+    int ret = count_call(STAT_MKDIR, [&] { return mkdir(pathname, mode); });
     if (ret < 0 && errno != EEXIST) {
         PLOGE("mkdir %s %u", pathname, mode);
     }
@@ -476,7 +1019,7 @@ int xmkdir(const char *pathname, mode_t mode) {
 }
 
 int xopen(const char *pathname, int flags) {
-    int fd = open(pathname, flags);
+    int fd = count_call(STAT_OPEN, [&] { return open(pathname, flags); });
     if (fd < 0) {
         PLOGE("open: %s", pathname);
     }
@@ -484,7 +1027,7 @@ int xopen(const char *pathname, int flags) {
 }
 
 int xopen(const char *pathname, int flags, mode_t mode) {
-    int fd = open(pathname, flags, mode);
+    int fd = count_call(STAT_OPEN, [&] { return open(pathname, flags, mode); });
     if (fd < 0) {
         PLOGE("open: %s", pathname);
     }
@@ -492,7 +1035,7 @@ int xopen(const char *pathname, int flags, mode_t mode) {
 }
 
 int xopenat(int dirfd, const char *pathname, int flags) {
-    int fd = openat(dirfd, pathname, flags);
+    int fd = count_call(STAT_OPEN, [&] { return openat(dirfd, pathname, flags); });
     if (fd < 0) {
         PLOGE("openat: %s", pathname);
     }
@@ -500,7 +1043,7 @@ int xopenat(int dirfd, const char *pathname, int flags) {
 }
 
 int xopenat(int dirfd, const char *pathname, int flags, mode_t mode) {
-    int fd = openat(dirfd, pathname, flags, mode);
+    int fd = count_call(STAT_OPEN, [&] { return openat(dirfd, pathname, flags, mode); });
     if (fd < 0) {
         PLOGE("openat: %s", pathname);
     }
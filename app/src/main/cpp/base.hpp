@@ -6,9 +6,15 @@
 #include <sys/stat.h>
 #include <cstring>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <functional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include "logging.h"
@@ -27,12 +33,18 @@ struct module_info {
 #define WORKERDIR     INTLROOT "/worker"
 #define MODULEMNT     INTLROOT "/modules"
 
-struct dirent *xreaddir(DIR *dirp);
-
 // files
 
 using sFILE = std::unique_ptr<FILE, decltype(&fclose)>;
-using sDIR = std::unique_ptr<DIR, decltype(&closedir)>;
+// A functor, as the attributes of closedir are lost on a template argument
+struct dir_closer {
+    void operator()(DIR *dp) const {
+        if (dp)
+            closedir(dp);
+    }
+};
+
+using sDIR = std::unique_ptr<DIR, dir_closer>;
 
 sDIR make_dir(DIR *dp);
 
@@ -79,9 +91,183 @@ private:
     Func fn;
 };
 
-void cp_afc(const char *src, const char *dest);
+// Directory entry of a dir_reader batch. The name is null terminated
+// and points into the buffer of the reader, valid until the next read().
+struct dir_entry {
+    std::string_view name;
+    ino_t ino;
+    unsigned char type;
+};
+
+// Directory reader on top of getdents64.
+//
+// Each read() fetches a batch of entries into a large buffer, which is then
+// iterated in place. "." and ".." are skipped. Buffers are recycled between
+// readers on the same thread, nested readers each get their own.
+class dir_reader {
+    DISALLOW_COPY_AND_MOVE(dir_reader)
+
+    struct raw_dirent {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+public:
+    class iterator {
+    public:
+        iterator(const char *p, const char *end) : p(p), end(end) { skip_dots(); }
+
+        dir_entry operator*() const {
+            auto d = reinterpret_cast<const raw_dirent *>(p);
+            return {{d->d_name, strlen(d->d_name)}, static_cast<ino_t>(d->d_ino), d->d_type};
+        }
+
+        iterator &operator++() {
+            p += reinterpret_cast<const raw_dirent *>(p)->d_reclen;
+            skip_dots();
+            return *this;
+        }
+
+        bool operator!=(const iterator &o) const { return p != o.p; }
+
+    private:
+        void skip_dots() {
+            for (; p != end; p += reinterpret_cast<const raw_dirent *>(p)->d_reclen) {
+                auto n = reinterpret_cast<const raw_dirent *>(p)->d_name;
+                if (n[0] != '.' || (n[1] != '\0' && (n[1] != '.' || n[2] != '\0')))
+                    break;
+            }
+        }
+
+        const char *p;
+        const char *end;
+    };
 
-void clone_attr(const char *src, const char *dest);
+    // Take ownership of fd, a negative fd reads as an empty directory
+    explicit dir_reader(int fd);
+
+    ~dir_reader();
+
+    int fd() const { return _fd; }
+
+    // Fetch the next batch of entries.
+    // Return false at the end of the directory or on error.
+    bool read();
+
+    iterator begin() const { return {buf, buf + len}; }
+
+    iterator end() const { return {buf + len, buf + len}; }
+
+private:
+    int _fd;
+    char *buf;
+    size_t len = 0;
+};
+
+// Run fn(i) for every i in [0, n) on up to jobs threads, including the caller.
+// Indices are handed out in order, but may complete in any order.
+template<class Func>
+void parallel_for(size_t n, int jobs, const Func &fn) {
+    if (jobs <= 1 || n <= 1) {
+        for (size_t i = 0; i < n; ++i)
+            fn(i);
+        return;
+    }
+    std::atomic_size_t next = 0;
+    auto worker = [&] {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+            fn(i);
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min<size_t>(jobs, n); ++t)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t: threads)
+        t.join();
+}
+
+// Work-stealing pool for tasks that spawn more tasks, such as the directories of a
+// tree. Each thread runs the tasks it spawned last first, and steals the oldest task
+// of another thread when it has none left.
+class task_pool {
+public:
+    explicit task_pool(int jobs) : queues(jobs > 0 ? jobs : 1) {}
+
+    // Queue fn, from a task or before run()
+    void spawn(std::function<void()> fn);
+
+    // Run on up to jobs threads, including the caller, until every task is done
+    void run();
+
+private:
+    struct queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool next(size_t self, std::function<void()> &fn);
+
+    void worker(size_t self);
+
+    std::vector<queue> queues;
+    // Spawned and not done yet
+    std::atomic_size_t pending = 0;
+    // Waiting in a queue
+    std::atomic_size_t queued = 0;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+
+    // Queue of the calling thread
+    inline static thread_local size_t current = 0;
+};
+
+// Copy src to dest with attributes. Regular files of a directory tree are
+// copied on up to jobs threads.
+void cp_afc(const char *src, const char *dest, int jobs = 1);
+
+// Copy size bytes from sfd to dfd. Tries FICLONE, then copy_file_range, then sendfile,
+// remembering the first method that works for each pair of filesystems.
+int copy_data(int sfd, int dfd, size_t size, dev_t sdev, dev_t ddev);
+
+// Copy permissions, owner and SELinux context of src to dest. The current attributes
+// of dest are read first and only the differing ones are written. If fresh, dest was
+// just created by us with mode 0, so it is not read back.
+void clone_attr(const char *src, const char *dest, bool fresh = false);
+
+// Whether dest already has the attributes clone_attr would give it from src
+bool same_attr(const char *src, const char *dest);
+
+// Syscalls issued and skipped when copying attributes
+struct attr_stats {
+    size_t chmod;
+    size_t chown;
+    size_t setcon;
+    size_t skip_chmod;
+    size_t skip_chown;
+    size_t skip_setcon;
+    // lstat and lgetxattr calls of destinations that were read back
+    size_t reads;
+    // distinct SELinux contexts
+    size_t contexts;
+};
+
+attr_stats get_attr_stats();
+
+// SELinux context of a file, interned so contexts compare by pointer.
+// con is null if the file has none.
+int get_con(const char *path, const char **con);
+int get_con(int fd, const char **con);
+
+// lstat relative to dirfd that only fetches the file type. Uses statx without
+// syncing attributes from remote filesystems, and fstatat on kernels without it.
+int fstatat_type(int dirfd, const char *name, mode_t *mode);
+
+// stat of path and the id of the mount it is on in the same statx call, as in
+// mountinfo. mnt_id is 0 on kernels before 5.8, which do not return it.
+int stat_mount(const char *path, struct stat *st, uint64_t *mnt_id);
 
 int mkdirs(const char *path, mode_t mode);
 int xmkdirs(const char *path, mode_t mode);
@@ -114,12 +300,33 @@ int xmount(const char *source, const char *target,
            const char *filesystemtype, unsigned long mountflags,
            const void *data);
 
+// Attach a copy of the whole mount tree at source onto target with the new mount API.
+// The copy is cloned detached with open_tree, made private recursively with a single
+// mount_setattr, and becomes visible at once with move_mount. Fail with ENOSYS if the
+// kernel lacks the API, the caller is expected to fall back to mount(2).
+int xattach_tree(const char *source, const char *target);
+
+// Open path in a detached copy of the mount it is on, without any mount below it.
+// Lookups relative to the fd see the filesystem under mounts stacked on its
+// subdirectories. Fail with ENOSYS if the kernel lacks open_tree, or with EPERM
+// without CAP_SYS_ADMIN. Errors are left to the caller to report.
+int open_under_mounts(const char *path);
+
+// Switch to the mount namespace of pid through a pidfd, or its /proc ns file on
+// kernels before 5.8. The process must be single threaded.
+int enter_mount_ns(int pid);
+
+// Parse a comma separated list of pids, false if any is not a positive number
+bool parse_pids(std::string_view list, std::vector<int> &pids);
+
 int xsymlink(const char *target, const char *linkpath);
 int xsymlinkat(const char *target, int newdirfd, const char *linkpath);
 
 ssize_t xreadlink(const char *pathname, char *buf, size_t bufsiz);
 ssize_t xreadlinkat(int dirfd, const char *pathname, char *buf, size_t bufsiz);
 
+ssize_t xwrite(int fd, const void *buf, size_t count);
+
 ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count);
 
 int xlstat(const char *pathname, struct stat *buf);
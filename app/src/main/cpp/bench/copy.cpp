@@ -0,0 +1,144 @@
+// Microbenchmark of copying a directory tree: one sendfile per file, as cp_afc
+// used to do, against copy_data, and cp_afc with and without threads.
+//
+// usage: bench_copy [--files n] [--size bytes] [--jobs n] [--rounds n] [src_parent] [dest_parent]
+//
+// The source tree is generated in src_parent (default TMPDIR or /data/local/tmp),
+// copies are made in dest_parent (default the same), which should be a tmpfs like
+// the magic mount work dir to match the real workload.
+
+#include <sys/sendfile.h>
+#include <ftw.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "../base.hpp"
+
+using namespace std::string_view_literals;
+
+static uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000'000ULL + ts.tv_nsec;
+}
+
+static void rm_rf(const char *path) {
+    nftw(path, [](const char *p, const struct stat *, int type, FTW *) {
+        return type == FTW_DP ? rmdir(p) : unlink(p);
+    }, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Walk the tree like clone_dir, copying regular files with copy(sfd, dfd, size)
+template<class Copy>
+static void walk(int src, int dest, const Copy &copy) {
+    dir_reader dir(src);
+    while (dir.read()) {
+        for (auto e: dir) {
+            const char *name = e.name.data();
+            if (e.type == DT_DIR) {
+                mkdirat(dest, name, 0755);
+                int dfd = openat(dest, name, O_RDONLY | O_CLOEXEC);
+                walk(openat(src, name, O_RDONLY | O_CLOEXEC), dfd, copy);
+                close(dfd);
+            } else if (e.type == DT_REG) {
+                int sfd = openat(src, name, O_RDONLY | O_CLOEXEC);
+                int dfd = openat(dest, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                struct stat st{};
+                fstat(sfd, &st);
+                copy(sfd, dfd, st);
+                close(dfd);
+                close(sfd);
+            }
+        }
+    }
+}
+
+template<class Copy>
+static void copy_tree(const char *src, const char *dest, const Copy &copy) {
+    mkdir(dest, 0755);
+    int dfd = open(dest, O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    fstat(dfd, &st);
+    walk(open(src, O_RDONLY | O_CLOEXEC), dfd, [&](int sfd, int fd, const struct stat &sst) {
+        copy(sfd, fd, sst, st.st_dev);
+    });
+    close(dfd);
+}
+
+template<class Copy>
+static void run(const char *label, const std::string &src, const std::string &dest, int rounds, Copy copy) {
+    std::vector<uint64_t> times;
+    for (int i = 0; i < rounds; ++i) {
+        rm_rf(dest.data());
+        auto start = now_ns();
+        copy(src.data(), dest.data());
+        times.push_back(now_ns() - start);
+    }
+    rm_rf(dest.data());
+    std::sort(times.begin(), times.end());
+    printf("%-12s median=%.2fms min=%.2fms\n", label, times[times.size() / 2] / 1e6, times[0] / 1e6);
+}
+
+int main(int argc, char **argv) {
+    int files = 2000;
+    size_t size = 64 * 1024;
+    int jobs = 4;
+    int rounds = 10;
+    std::vector<const char *> dirs;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == "--files"sv && i + 1 < argc) {
+            files = atoi(argv[++i]);
+        } else if (argv[i] == "--size"sv && i + 1 < argc) {
+            size = strtoul(argv[++i], nullptr, 0);
+        } else if (argv[i] == "--jobs"sv && i + 1 < argc) {
+            jobs = std::max(1, atoi(argv[++i]));
+        } else if (argv[i] == "--rounds"sv && i + 1 < argc) {
+            rounds = std::max(1, atoi(argv[++i]));
+        } else {
+            dirs.push_back(argv[i]);
+        }
+    }
+    const char *tmp = getenv("TMPDIR");
+    std::string src = std::string(dirs.size() > 0 ? dirs[0] : tmp ? tmp : "/data/local/tmp") + "/bench_copy_src";
+    std::string dest = std::string(dirs.size() > 1 ? dirs[1] : tmp ? tmp : "/data/local/tmp") + "/bench_copy_dst";
+
+    // 100 files per directory, like a module with many libraries
+    rm_rf(src.data());
+    mkdir(src.data(), 0755);
+    std::string data(size, 'x');
+    char path[4096];
+    for (int i = 0; i < files; ++i) {
+        snprintf(path, sizeof(path), "%s/dir%d", src.data(), i / 100);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/dir%d/lib%d.so", src.data(), i / 100, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        xwrite(fd, data.data(), data.size());
+        close(fd);
+    }
+    printf("%d files of %zu bytes\n", files, size);
+
+    // Data only, the same walk with a different copy of each file
+    run("sendfile", src, dest, rounds, [](const char *s, const char *d) {
+        copy_tree(s, d, [](int sfd, int dfd, const struct stat &st, dev_t) {
+            sendfile(dfd, sfd, nullptr, st.st_size);
+        });
+    });
+    run("copy_data", src, dest, rounds, [](const char *s, const char *d) {
+        copy_tree(s, d, [](int sfd, int dfd, const struct stat &st, dev_t ddev) {
+            copy_data(sfd, dfd, st.st_size, st.st_dev, ddev);
+        });
+    });
+
+    // Including attributes
+    run("cp_afc", src, dest, rounds, [](const char *s, const char *d) { cp_afc(s, d); });
+    char label[32];
+    snprintf(label, sizeof(label), "cp_afc -j%d", jobs);
+    run(label, src, dest, rounds, [=](const char *s, const char *d) { cp_afc(s, d, jobs); });
+
+    rm_rf(src.data());
+    return 0;
+}
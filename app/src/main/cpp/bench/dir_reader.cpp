@@ -0,0 +1,126 @@
+// Microbenchmark of directory scanning: readdir with per entry filtering of
+// "." and "..", as xreaddir used to do, against the batched dir_reader.
+//
+// usage: bench_dir_reader [--entries n] [--rounds n] [dir]
+//
+// Without dir, a temporary directory with n empty files is created and removed.
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "../base.hpp"
+
+using namespace std::string_view_literals;
+
+struct result {
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t batches = 0;
+};
+
+static uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000'000ULL + ts.tv_nsec;
+}
+
+static result scan_readdir(const char *path) {
+    result r;
+    auto dir = open_dir(path);
+    if (!dir)
+        return r;
+    for (dirent *e; (e = readdir(dir.get()));) {
+        if (e->d_name == "."sv || e->d_name == ".."sv)
+            continue;
+        r.entries++;
+        r.bytes += strlen(e->d_name) + e->d_type;
+    }
+    return r;
+}
+
+static result scan_dir_reader(const char *path) {
+    result r;
+    dir_reader dir(open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    while (dir.read()) {
+        r.batches++;
+        for (auto e: dir) {
+            r.entries++;
+            r.bytes += e.name.size() + e.type;
+        }
+    }
+    return r;
+}
+
+template<class Scan>
+static void run(const char *label, const char *path, int rounds, Scan scan) {
+    std::vector<uint64_t> times;
+    result r;
+    for (int i = 0; i < rounds; ++i) {
+        auto start = now_ns();
+        r = scan(path);
+        times.push_back(now_ns() - start);
+    }
+    std::sort(times.begin(), times.end());
+    auto median = times[times.size() / 2];
+    printf("%-10s entries=%zu median=%.1fus min=%.1fus per_entry=%.1fns",
+           label, r.entries, median / 1e3, times[0] / 1e3,
+           r.entries ? static_cast<double>(median) / r.entries : 0.0);
+    if (r.batches)
+        printf(" batches=%zu", r.batches);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    int entries = 5000;
+    int rounds = 50;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == "--entries"sv && i + 1 < argc) {
+            entries = atoi(argv[++i]);
+        } else if (argv[i] == "--rounds"sv && i + 1 < argc) {
+            rounds = std::max(1, atoi(argv[++i]));
+        } else {
+            path = argv[i];
+        }
+    }
+
+    std::string tmp;
+    if (!path) {
+        const char *base = getenv("TMPDIR");
+        tmp = std::string(base ? base : "/data/local/tmp") + "/bench_dir_reader.XXXXXX";
+        if (!mkdtemp(tmp.data())) {
+            perror("mkdtemp");
+            return 1;
+        }
+        int dfd = open(tmp.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        char name[32];
+        for (int i = 0; i < entries; ++i) {
+            snprintf(name, sizeof(name), "entry_%08d.so", i);
+            close(openat(dfd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+        }
+        close(dfd);
+        path = tmp.data();
+    }
+
+    // Warm up the dentry cache
+    scan_readdir(path);
+    run("readdir", path, rounds, scan_readdir);
+    run("dir_reader", path, rounds, scan_dir_reader);
+
+    if (!tmp.empty()) {
+        int dfd = open(tmp.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        char name[32];
+        for (int i = 0; i < entries; ++i) {
+            snprintf(name, sizeof(name), "entry_%08d.so", i);
+            unlinkat(dfd, name, 0);
+        }
+        close(dfd);
+        rmdir(tmp.data());
+    }
+    return 0;
+}
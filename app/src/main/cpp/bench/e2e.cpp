@@ -0,0 +1,377 @@
+// End to end benchmark of magic_mount on synthetic modules, runnable on a Linux host.
+//
+// usage: bench_e2e [--binary path] [--scales n1,n2,...] [--depth n] [--fanout n] [--files n]
+//                  [--module-files n] [--replace ratio] [--symlinks ratio] [--rounds n]
+//                  [--seed n] [-- magic_mount options...]
+//
+// The driver enters a new user and mount namespace, so no privilege is needed, and
+// chroots into a tmpfs with the host directories bound in. There it generates a real
+// /system of the given depth and fan-out with files in every directory, and for every
+// scale that many modules in /data/adb/modules. Each module adds module-files entries
+// to random directories: a part replaces existing files, the rest are new files, and
+// the symlink ratio of them are symlinks. The replace ratio of module directories get
+// a .replace file. magic_mount mount and umount are run rounds times per scale and the
+// median of the phase timings they log is reported.
+
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+using namespace std::string_view_literals;
+
+struct options {
+    vector<int> scales{10, 100, 1000};
+    int depth = 3;
+    int fanout = 6;
+    int files = 8;
+    int module_files = 20;
+    double replace = 0.05;
+    double symlinks = 0.1;
+    int rounds = 5;
+    uint64_t seed = 1;
+    vector<const char *> extra;
+};
+
+// xorshift64*, so runs are reproducible
+struct rng {
+    uint64_t s;
+
+    explicit rng(uint64_t seed) : s(seed * 0x9e3779b97f4a7c15ULL + 1) {}
+
+    uint64_t next() {
+        s ^= s >> 12;
+        s ^= s << 25;
+        s ^= s >> 27;
+        return s * 0x2545f4914f6cdd1dULL;
+    }
+
+    int below(int n) { return static_cast<int>(next() % n); }
+
+    bool chance(double p) { return (next() >> 11) * 0x1.0p-53 < p; }
+};
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+static void write_file(const char *path, const char *data) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        die(path);
+    if (write(fd, data, strlen(data)) < 0)
+        die(path);
+    close(fd);
+}
+
+static void mkdirs(string path) {
+    for (size_t pos = 1; (pos = path.find('/', pos)) != string::npos; ++pos) {
+        path[pos] = '\0';
+        mkdir(path.data(), 0755);
+        path[pos] = '/';
+    }
+    mkdir(path.data(), 0755);
+}
+
+static void rm_rf(const char *path) {
+    nftw(path, [](const char *p, const struct stat *, int type, FTW *) {
+        return type == FTW_DP ? rmdir(p) : unlink(p);
+    }, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Directories d0..d<fanout-1> down to depth levels, files f0..f<files-1> in each
+static size_t gen_real(string &path, int level, const options &o) {
+    size_t n = 0;
+    char name[32];
+    for (int i = 0; i < o.files; ++i, ++n) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        write_file((path + name).data(), "real\n");
+    }
+    if (level == o.depth)
+        return n;
+    for (int i = 0; i < o.fanout; ++i) {
+        snprintf(name, sizeof(name), "/d%d", i);
+        path += name;
+        mkdir(path.data(), 0755);
+        n += gen_real(path, level + 1, o) + 1;
+        path.resize(path.size() - strlen(name));
+    }
+    return n;
+}
+
+static size_t gen_module(int index, rng &r, const options &o) {
+    char name[64];
+    snprintf(name, sizeof(name), "/data/adb/modules/mod%d", index);
+    string root = string(name) + "/system";
+    mkdirs(root);
+    size_t n = 0;
+    for (int k = 0; k < o.module_files; ++k, ++n) {
+        string path = root;
+        int level = r.below(o.depth + 1);
+        for (int l = 0; l < level; ++l) {
+            snprintf(name, sizeof(name), "/d%d", r.below(o.fanout));
+            path += name;
+        }
+        struct stat st{};
+        if (stat(path.data(), &st) != 0) {
+            mkdirs(path);
+            if (level > 0 && r.chance(o.replace))
+                write_file((path + "/.replace").data(), "");
+        }
+        // A quarter are new files, the rest replace real ones
+        if (r.below(4) == 0)
+            snprintf(name, sizeof(name), "/mod%d_%d", index, k);
+        else
+            snprintf(name, sizeof(name), "/f%d", r.below(max(o.files, 1)));
+        path += name;
+        unlink(path.data());
+        if (r.chance(o.symlinks))
+            symlink("/system/f0", path.data());
+        else
+            write_file(path.data(), "module\n");
+    }
+    return n;
+}
+
+static size_t count_mounts() {
+    FILE *fp = fopen("/proc/self/mountinfo", "re");
+    if (!fp)
+        return 0;
+    size_t n = 0;
+    for (int ch; (ch = fgetc(fp)) != EOF;)
+        n += ch == '\n';
+    fclose(fp);
+    return n;
+}
+
+// Run the binary and collect the "timing: name value ms" pairs it logs
+static bool run(int bin, vector<const char *> args, map<string, double> &timing) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0)
+        die("pipe");
+    args.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDERR_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        setenv("MAGIC_MOUNT_LOG", "I", 1);
+        fexecve(bin, const_cast<char **>(args.data()), environ);
+        _exit(127);
+    }
+    close(fds[1]);
+    string out;
+    char buf[4096];
+    for (ssize_t len; (len = read(fds[0], buf, sizeof(buf))) > 0;)
+        out.append(buf, len);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+
+    for (size_t pos = 0; (pos = out.find("timing:", pos)) != string::npos;) {
+        auto end = out.find('\n', pos);
+        string line = out.substr(pos + 7, end - pos - 7);
+        pos = end;
+        char name[32];
+        double value;
+        int used;
+        for (const char *p = line.data(); sscanf(p, " %31s %lfms%n", name, &value, &used) == 2; p += used)
+            timing[name] = value;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s %s failed:\n%s", args[0], args[1], out.data());
+        return false;
+    }
+    return true;
+}
+
+// New user and mount namespace, chrooted into a tmpfs with the host directories bound in
+static void enter_sandbox(const char *root) {
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0)
+        die("unshare");
+    char map[64];
+    write_file("/proc/self/setgroups", "deny");
+    snprintf(map, sizeof(map), "0 %u 1", uid);
+    write_file("/proc/self/uid_map", map);
+    snprintf(map, sizeof(map), "0 %u 1", gid);
+    write_file("/proc/self/gid_map", map);
+
+    if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0)
+        die("make private");
+    if (mount("bench", root, "tmpfs", 0, "mode=755") != 0)
+        die("mount root");
+
+    // What the benchmark generates, or must not be shared with the host
+    static constexpr string_view own[] = {
+            "system", "vendor", "product", "system_ext", "odm", "data", "debug_ramdisk", "tmp",
+    };
+    auto dir = opendir("/");
+    for (dirent *e; (e = readdir(dir));) {
+        string_view name = e->d_name;
+        if (name == "."sv || name == ".."sv || find(begin(own), end(own), name) != end(own))
+            continue;
+        string src = string("/") + e->d_name;
+        string dest = string(root) + src;
+        if (e->d_type == DT_LNK) {
+            char target[4096];
+            ssize_t len = readlink(src.data(), target, sizeof(target) - 1);
+            if (len > 0) {
+                target[len] = '\0';
+                symlink(target, dest.data());
+            }
+        } else if (e->d_type == DT_DIR) {
+            mkdir(dest.data(), 0755);
+            if (mount(src.data(), dest.data(), nullptr, MS_BIND | MS_REC, nullptr) != 0)
+                fprintf(stderr, "bind %s: %s\n", src.data(), strerror(errno));
+        }
+    }
+    closedir(dir);
+
+    if (chroot(root) != 0 || chdir("/") != 0)
+        die("chroot");
+    mkdir("/tmp", 01777);
+    mkdir("/system", 0755);
+    mkdir("/debug_ramdisk", 0755);
+    // Module files are told apart by their path on the data partition
+    mkdir("/data", 0755);
+    if (mount("data", "/data", "tmpfs", 0, "mode=755") != 0)
+        die("mount data");
+    mkdirs("/data/adb/modules");
+}
+
+static double median(vector<double> v) {
+    if (v.empty())
+        return 0;
+    sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+static int bench(int bin, const options &o) {
+    printf("depth %d, fan-out %d, %d files per dir, %d files per module, "
+           "replace %.2f, symlinks %.2f, %d rounds\n",
+           o.depth, o.fanout, o.files, o.module_files, o.replace, o.symlinks, o.rounds);
+    string path = "/system";
+    size_t real = gen_real(path, 0, o);
+    printf("%zu real entries\n", real);
+    printf("%8s %8s %7s %10s %10s %10s %10s %10s %10s\n",
+           "modules", "entries", "mounts", "enumerate", "collect", "prepare", "mount", "remount_ro", "umount");
+
+    static constexpr const char *phases[] = {"enumerate", "collect", "prepare", "mount", "remount_ro", "umount"};
+    for (int scale: o.scales) {
+        rm_rf("/data/adb/modules");
+        mkdirs("/data/adb/modules");
+        rng r(o.seed);
+        size_t entries = 0;
+        for (int i = 0; i < scale; ++i)
+            entries += gen_module(i, r, o);
+
+        map<string, vector<double>> times;
+        size_t base = count_mounts();
+        size_t mounts = 0;
+        for (int round = 0; round < o.rounds; ++round) {
+            map<string, double> timing;
+            vector<const char *> args{"magic_mount", "mount"};
+            args.insert(args.end(), o.extra.begin(), o.extra.end());
+            if (!run(bin, args, timing))
+                return 1;
+            mounts = count_mounts() - base;
+            if (!run(bin, {"magic_mount", "umount"}, timing))
+                return 1;
+            if (count_mounts() != base)
+                fprintf(stderr, "umount left %zu mounts\n", count_mounts() - base);
+            for (auto phase: phases)
+                times[phase].push_back(timing[phase]);
+        }
+        printf("%8d %8zu %7zu", scale, entries, mounts);
+        for (auto phase: phases)
+            printf(" %8.2fms", median(times[phase]));
+        printf("\n");
+        fflush(stdout);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    options o;
+    string binary;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == "--binary"sv && i + 1 < argc) {
+            binary = argv[++i];
+        } else if (argv[i] == "--scales"sv && i + 1 < argc) {
+            o.scales.clear();
+            for (char *p = argv[++i]; *p;) {
+                o.scales.push_back(max(1, static_cast<int>(strtol(p, &p, 10))));
+                if (*p == ',')
+                    ++p;
+                else
+                    break;
+            }
+        } else if (argv[i] == "--depth"sv && i + 1 < argc) {
+            o.depth = max(0, atoi(argv[++i]));
+        } else if (argv[i] == "--fanout"sv && i + 1 < argc) {
+            o.fanout = max(1, atoi(argv[++i]));
+        } else if (argv[i] == "--files"sv && i + 1 < argc) {
+            o.files = max(0, atoi(argv[++i]));
+        } else if (argv[i] == "--module-files"sv && i + 1 < argc) {
+            o.module_files = max(1, atoi(argv[++i]));
+        } else if (argv[i] == "--replace"sv && i + 1 < argc) {
+            o.replace = atof(argv[++i]);
+        } else if (argv[i] == "--symlinks"sv && i + 1 < argc) {
+            o.symlinks = atof(argv[++i]);
+        } else if (argv[i] == "--rounds"sv && i + 1 < argc) {
+            o.rounds = max(1, atoi(argv[++i]));
+        } else if (argv[i] == "--seed"sv && i + 1 < argc) {
+            o.seed = strtoull(argv[++i], nullptr, 0);
+        } else if (argv[i] == "--"sv) {
+            o.extra.assign(argv + i + 1, argv + argc);
+            break;
+        }
+    }
+
+    // The magic_mount next to this binary by default
+    if (binary.empty()) {
+        char self[4096];
+        ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (len < 0)
+            die("readlink");
+        self[len] = '\0';
+        binary = string(self, strrchr(self, '/') + 1) + "magic_mount";
+    }
+    // Opened before entering the sandbox, where host paths may be hidden
+    int bin = open(binary.data(), O_RDONLY | O_CLOEXEC);
+    if (bin < 0)
+        die(binary.data());
+
+    const char *tmp = getenv("TMPDIR");
+    string root = string(tmp ? tmp : "/tmp") + "/bench_e2e.XXXXXX";
+    if (!mkdtemp(root.data()))
+        die("mkdtemp");
+
+    // The sandbox goes away with the child
+    pid_t pid = fork();
+    if (pid == 0) {
+        enter_sandbox(root.data());
+        exit(bench(bin, o));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    rmdir(root.data());
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
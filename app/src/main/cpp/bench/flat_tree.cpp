@@ -0,0 +1,194 @@
+// Microbenchmark of the in-memory node tree: the node objects mount() walks,
+// against the same tree copied into a flat_tree.
+//
+// usage: bench_flat_tree [--nodes n] [--rounds n]
+//
+// A synthetic tree of about n nodes is built like a prepared one: directories
+// alternate between tmpfs, where every real entry is a node of its own, and
+// intermediate ones holding module files. For each layout the resident memory it
+// adds and the median time of a full pre-order traversal are printed. Both
+// traversals compute the tree signature, which must match. The flat one also
+// builds the path of every node, as mount() needs it.
+
+#include <malloc.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../main.hpp"
+#include "../base.hpp"
+#include "../cache.hpp"
+#include "../flat_tree.hpp"
+
+using namespace std::string_view_literals;
+
+// Options main.cpp defines for the linked magic_mount code
+std::vector<std::string> partitions;
+int jobs = 1;
+std::string cache_path;
+bool new_mount_api = false;
+bool use_overlay = false;
+bool optimize_tree = false;
+bool stage_mounts = false;
+bool verify_mounts = false;
+
+std::string get_magisk_tmp() { return "/debug_ramdisk"; }
+
+bool mount_work_dir(const char *) { return false; }
+
+void umount_work_dir() {}
+
+// Resident or peak resident memory of this process in KiB
+static size_t status_kb(const char *field) {
+    auto fp = xopen_file("/proc/self/status", "re");
+    char line[256];
+    size_t len = strlen(field);
+    while (fp && fgets(line, sizeof(line), fp.get())) {
+        if (strncmp(line, field, len) == 0)
+            return strtoull(line + len + 1, nullptr, 10);
+    }
+    return 0;
+}
+
+static const char *const module_names[] = {"mod_a", "mod_b", "mod_c", "mod_d"};
+
+// Breadth first, each directory gets files entries and fanout subdirectories
+static root_node *build(size_t nodes, size_t files, size_t fanout) {
+    auto root = new root_node("");
+    auto system = new root_node("system");
+    root->insert(system);
+    std::vector<dir_node *> queue{system};
+    char name[32];
+    size_t count = 2;
+    for (size_t i = 0; i < queue.size() && count < nodes; ++i) {
+        auto dir = queue[i];
+        bool tmpfs = isa<tmpfs_node>(dir);
+        for (size_t f = 0; f < files && count < nodes; ++f, ++count) {
+            snprintf(name, sizeof(name), "lib%zu_%zu.so", i, f);
+            if (tmpfs) {
+                dir->emplace<tmpfs_node>(name, name);
+            } else {
+                dir_entry entry{name, 0, static_cast<unsigned char>(f % 8 ? DT_REG : DT_LNK)};
+                dir->emplace<module_node>(name, module_names[f % 4], entry);
+            }
+        }
+        for (size_t d = 0; d < fanout && count < nodes; ++d, ++count) {
+            snprintf(name, sizeof(name), "dir%zu", d);
+            // Deeper levels are mostly tmpfs, as below a tmpfs everything is
+            if (tmpfs || d % 2)
+                queue.push_back(dir->emplace<tmpfs_node>(name, name));
+            else
+                queue.push_back(dir->emplace<inter_node>(name, name));
+        }
+    }
+    return root;
+}
+
+// The same hash as tree_cache::signature, over the flat tree
+struct flat_signature {
+    const flat_tree &tree;
+    fingerprint fp;
+    size_t nodes = 0;
+    size_t path_bytes = 0;
+
+    void node(flat_tree::index i, const std::string &path) {
+        nodes++;
+        path_bytes += path.size();
+        fp.add(tree.name(i));
+        uint8_t types[] = {tree.node_type(i), tree.file_type_bits(i)};
+        fp.add(types, sizeof(types));
+    }
+
+    void dir(flat_tree::index i, const std::string &path) {
+        node(i, path);
+        auto count = static_cast<uint32_t>(tree.child_count(i));
+        fp.add(&count, sizeof(count));
+    }
+
+    void inter(flat_tree::index i, const std::string &path) { dir(i, path); }
+
+    void tmpfs(flat_tree::index i, const std::string &path) { dir(i, path); }
+
+    void root(flat_tree::index i, const std::string &path) { dir(i, path); }
+
+    void module(flat_tree::index i, const std::string &path) {
+        node(i, path);
+        fp.add(tree.module(i));
+        // The synthetic partitions have no /system prefix
+        source.assign(node_entry::module_mnt).append(tree.module(i)).append(path);
+        tree_cache::add_source(fp, source.data());
+    }
+
+    std::string source;
+};
+
+template<class Func>
+static double median_us(int rounds, const Func &fn) {
+    std::vector<uint64_t> times;
+    for (int i = 0; i < rounds; ++i) {
+        auto start = now_ns();
+        fn();
+        times.push_back(now_ns() - start);
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2] / 1e3;
+}
+
+int main(int argc, char **argv) {
+    size_t nodes = 100000;
+    int rounds = 20;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i] == "--nodes"sv && i + 1 < argc) {
+            nodes = strtoull(argv[++i], nullptr, 10);
+        } else if (argv[i] == "--rounds"sv && i + 1 < argc) {
+            rounds = std::max(1, atoi(argv[++i]));
+        }
+    }
+
+    size_t base_kb = status_kb("VmRSS:");
+    uint64_t node_sig, flat_sig;
+    size_t node_kb, arena_kb, flat_kb, flat_bytes, flat_nodes;
+    double node_us, flat_us, flatten_us;
+    flat_tree *flat;
+    {
+        arena tree_arena;
+        auto start = now_ns();
+        auto root = build(nodes, 16, 4);
+        double build_us = (now_ns() - start) / 1e3;
+        node_kb = status_kb("VmRSS:") - base_kb;
+        arena_kb = tree_arena.get_stats().bytes / 1024;
+        printf("built %zu nodes in %.1fms\n", nodes, build_us / 1e3);
+
+        node_path_buf path(get_magisk_tmp());
+        node_us = median_us(rounds, [&] { node_sig = tree_cache::signature(root, path); });
+
+        start = now_ns();
+        flat = new flat_tree(root);
+        flatten_us = (now_ns() - start) / 1e3;
+    }
+    // The node tree is gone with its arena
+    malloc_trim(0);
+    flat_kb = status_kb("VmRSS:") - base_kb;
+    flat_bytes = flat->memory();
+    flat_nodes = flat->size();
+
+    std::string path;
+    flat_us = median_us(rounds, [&] {
+        flat_signature v{*flat};
+        path.clear();
+        flat->walk(v, path);
+        flat_sig = v.fp.value;
+    });
+
+    printf("%-6s nodes=%zu rss=%zuKiB bytes=%zuKiB per_node=%.1fB traverse=%.1fus per_node=%.1fns\n",
+           "nodes", flat_nodes, node_kb, arena_kb, arena_kb * 1024.0 / flat_nodes,
+           node_us, node_us * 1e3 / flat_nodes);
+    printf("%-6s nodes=%zu rss=%zuKiB bytes=%zuKiB per_node=%.1fB traverse=%.1fus per_node=%.1fns flatten=%.1fus\n",
+           "flat", flat_nodes, flat_kb, flat_bytes / 1024, static_cast<double>(flat_bytes) / flat_nodes,
+           flat_us, flat_us * 1e3 / flat_nodes, flatten_us);
+    printf("peak rss %zuKiB, signatures %s\n", status_kb("VmHWM:"), node_sig == flat_sig ? "match" : "DIFFER");
+    delete flat;
+    return node_sig == flat_sig ? 0 : 1;
+}
@@ -0,0 +1,375 @@
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+#include "main.hpp"
+#include "base.hpp"
+#include "node.hpp"
+#include "cache.hpp"
+
+using namespace std;
+
+#define CACHE_MAGIC    0x4354'4d4d    /* "MMTC" */
+#define CACHE_VERSION  1
+
+#define CACHE_NO_MODULE      UINT32_MAX
+#define CACHE_PREFIX_SYSTEM  (1 << 0)    /* root_node with "/system" prefix */
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t stamp;
+    uint32_t node_count;
+    uint32_t pool_size;
+};
+
+// Nodes are stored in pre-order, each directory followed by its children
+struct cache_node {
+    uint32_t name;
+    uint32_t module;
+    uint32_t child_count;
+    uint8_t node_type;
+    uint8_t file_type;
+    uint8_t flags;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(cache_header) == 32 && sizeof(cache_node) == 16);
+
+struct cache_writer {
+    vector<cache_node> nodes;
+    string pool;
+    map<const char *, uint32_t> modules;
+
+    uint32_t add(string_view s) {
+        auto off = static_cast<uint32_t>(pool.size());
+        pool.append(s);
+        pool.push_back('\0');
+        return off;
+    }
+
+    uint32_t add_module(const char *module) {
+        auto [it, inserted] = modules.try_emplace(module, 0);
+        if (inserted)
+            it->second = add(module);
+        return it->second;
+    }
+};
+
+tree_cache::~tree_cache() {
+    if (map)
+        munmap(map, map_size);
+}
+
+// Stamp every existing real directory of the tree. Adding or removing entries
+// changes the mtime of the parent, so this covers every lstat done by prepare.
+void tree_cache::stamp(dir_node *dir, fingerprint &fp, string &path) {
+    for (auto &[name, node]: dir->children) {
+        auto dn = dyn_cast<dir_node>(node);
+        if (!dn || !dn->exist())
+            continue;
+        path.push_back('/');
+        path.append(name);
+        struct stat st{};
+        if (lstat(path.data(), &st) == 0)
+            fp.add(st);
+        fp.add(name);
+        stamp(dn, fp, path);
+        path.resize(path.size() - name.size() - 1);
+    }
+}
+
+void tree_cache::serialize(node_entry *node, cache_writer &w) {
+    auto idx = w.nodes.size();
+    w.nodes.push_back(cache_node{
+            .name = w.add(node->_name),
+            .module = CACHE_NO_MODULE,
+            .child_count = 0,
+            .node_type = node->_node_type,
+            .file_type = node->_file_type,
+    });
+    if (auto mn = dyn_cast<module_node>(node)) {
+        w.nodes[idx].module = w.add_module(mn->module);
+    } else if (auto rn = dyn_cast<root_node>(node); rn && rn->prefix[0]) {
+        w.nodes[idx].flags |= CACHE_PREFIX_SYSTEM;
+    }
+    if (auto dn = dyn_cast<dir_node>(node)) {
+        w.nodes[idx].child_count = static_cast<uint32_t>(dn->children.size());
+        for (auto &[_, child]: dn->children)
+            serialize(child, w);
+    }
+}
+
+void tree_cache::add_source(fingerprint &fp, const char *source) {
+    struct stat st{};
+    count_call(STAT_LSTAT, [&] { return lstat(source, &st); });
+    fp.add_mtime(st);
+}
+
+void tree_cache::signature(node_entry *node, node_path_buf &path, fingerprint &fp) {
+    fp.add(node->_name);
+    uint8_t types[] = {node->_node_type, node->_file_type};
+    fp.add(types, sizeof(types));
+    if (auto mn = dyn_cast<module_node>(node)) {
+        fp.add(mn->module);
+        add_source(fp, mn->source(path));
+    } else if (auto dn = dyn_cast<dir_node>(node)) {
+        auto count = static_cast<uint32_t>(dn->children.size());
+        fp.add(&count, sizeof(count));
+        for (auto &[name, child]: dn->children) {
+            path.push(name);
+            signature(child, path, fp);
+            path.pop(name);
+        }
+    }
+}
+
+uint64_t tree_cache::signature(node_entry *node, node_path_buf &path) {
+    fingerprint fp;
+    signature(node, path, fp);
+    return fp.value;
+}
+
+node_entry *tree_cache::restore(const cache_node *&it, const cache_node *end,
+                                const char *pool, size_t pool_size) {
+    if (it == end)
+        return nullptr;
+    const cache_node &n = *it++;
+    if (n.name >= pool_size)
+        return nullptr;
+
+    const char *name = pool + n.name;
+    node_entry *node;
+    switch (n.node_type) {
+        case TYPE_INTER:
+            node = new inter_node(name);
+            break;
+        case TYPE_TMPFS:
+            node = new tmpfs_node(name);
+            break;
+        case TYPE_MODULE:
+            if (n.module >= pool_size)
+                return nullptr;
+            node = new module_node(name, pool + n.module);
+            break;
+        case TYPE_ROOT:
+            if (n.flags & CACHE_PREFIX_SYSTEM)
+                node = new root_node(new inter_node(name));
+            else
+                node = new root_node(name);
+            break;
+        default:
+            return nullptr;
+    }
+    node->_file_type = n.file_type;
+
+    auto dn = dyn_cast<dir_node>(node);
+    if (!dn && n.child_count)
+        return nullptr;
+    if (!dn)
+        return node;
+    dn->children.begin_batch();
+    for (uint32_t i = 0; i < n.child_count; ++i) {
+        auto child = restore(it, end, pool, pool_size);
+        if (!child)
+            return nullptr;
+        child->_parent = dn;
+        dn->children.emplace(child->_name, child);
+    }
+    dn->children.commit();
+    return node;
+}
+
+root_node *tree_cache::load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(cache_header))) {
+        close(fd);
+        return nullptr;
+    }
+    map_size = st.st_size;
+    map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        PLOGE("mmap %s", path);
+        map = nullptr;
+        return nullptr;
+    }
+
+    auto hdr = static_cast<const cache_header *>(map);
+    if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION) {
+        LOGW("cache: %s has unknown format", path);
+        return nullptr;
+    }
+    if (hdr->key != key) {
+        LOGI("cache: modules or partitions changed");
+        return nullptr;
+    }
+    size_t size = sizeof(cache_header) + hdr->node_count * sizeof(cache_node) + hdr->pool_size;
+    auto nodes = reinterpret_cast<const cache_node *>(hdr + 1);
+    auto pool = reinterpret_cast<const char *>(nodes + hdr->node_count);
+    if (size != map_size || hdr->pool_size == 0 || pool[hdr->pool_size - 1] != '\0') {
+        LOGW("cache: %s is corrupted", path);
+        return nullptr;
+    }
+
+    auto it = nodes;
+    auto end = nodes + hdr->node_count;
+    auto node = restore(it, end, pool, hdr->pool_size);
+    if (!node || it != end || !isa<root_node>(node)) {
+        LOGW("cache: %s is corrupted", path);
+        return nullptr;
+    }
+    auto root = static_cast<root_node *>(node);
+
+    fingerprint fp;
+    string buf;
+    stamp(root, fp, buf);
+    if (fp.value != hdr->stamp) {
+        LOGI("cache: real directories changed");
+        return nullptr;
+    }
+    return root;
+}
+
+bool tree_cache::save(const char *path, root_node *root) {
+    cache_writer w;
+    serialize(root, w);
+    fingerprint fp;
+    string buf;
+    stamp(root, fp, buf);
+
+    cache_header hdr{
+            .magic = CACHE_MAGIC,
+            .version = CACHE_VERSION,
+            .key = key,
+            .stamp = fp.value,
+            .node_count = static_cast<uint32_t>(w.nodes.size()),
+            .pool_size = static_cast<uint32_t>(w.pool.size()),
+    };
+
+    string tmp = string(path) + ".tmp";
+    int fd = xopen(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+    bool ok = xwrite(fd, &hdr, sizeof(hdr)) >= 0 &&
+              xwrite(fd, w.nodes.data(), w.nodes.size() * sizeof(cache_node)) >= 0 &&
+              xwrite(fd, w.pool.data(), w.pool.size()) >= 0;
+    close(fd);
+    if (ok && rename(tmp.data(), path) != 0) {
+        PLOGE("rename %s", path);
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp.data());
+        return false;
+    }
+    LOGD("cache: saved %u nodes to %s", hdr.node_count, path);
+    return true;
+}
+
+/*********************
+ * Tree signatures
+ *********************/
+
+// Signatures that fell back to TREE_SIGNATURES, by target, until saved
+static mutex pending_lock;
+static vector<pair<string, uint64_t>> pending_signatures;
+
+static string signatures_path() {
+    return get_magisk_tmp() + "/" TREE_SIGNATURES;
+}
+
+static unordered_map<unsigned int, uint64_t> load_signatures() {
+    unordered_map<unsigned int, uint64_t> sigs;
+    auto fp = xopen_file(signatures_path().data(), "re");
+    unsigned int id;
+    unsigned long long sig;
+    while (fp && fscanf(fp.get(), "%u %llx", &id, &sig) == 2)
+        sigs[id] = sig;
+    return sigs;
+}
+
+void set_tree_signature(const char *worker, const char *target, uint64_t sig) {
+    if (count_call(STAT_SETXATTR, [&] {
+        return setxattr(worker, TREE_XATTR, &sig, sizeof(sig), 0);
+    }) == 0)
+        return;
+    if (errno != EPERM && errno != ENOTSUP) {
+        PLOGE("setxattr %s", worker);
+        return;
+    }
+    static atomic_bool logged;
+    if (!logged.exchange(true))
+        LOGW("cannot set %s (%s), tree signatures are kept in %s", TREE_XATTR, strerror(errno),
+             signatures_path().data());
+    lock_guard g(pending_lock);
+    pending_signatures.emplace_back(target, sig);
+}
+
+bool get_tree_signature(const char *target, unsigned int id, uint64_t &sig) {
+    if (count_call(STAT_GETXATTR, [&] {
+        return getxattr(target, TREE_XATTR, &sig, sizeof(sig));
+    }) == sizeof(sig))
+        return true;
+    {
+        // Mounted by this run, not saved yet
+        lock_guard g(pending_lock);
+        for (auto &[t, s]: pending_signatures) {
+            if (t == target) {
+                sig = s;
+                return true;
+            }
+        }
+    }
+    auto sigs = load_signatures();
+    auto it = sigs.find(id);
+    if (it == sigs.end())
+        return false;
+    sig = it->second;
+    return true;
+}
+
+void save_tree_signatures() {
+    lock_guard g(pending_lock);
+    if (pending_signatures.empty())
+        return;
+    // Mounts detached since are dropped, the last mount on a target is the new tmpfs
+    unordered_map<unsigned int, uint64_t> live;
+    unordered_map<string_view, unsigned int> by_target;
+    auto mounts = parse_mount_info("self");
+    for (auto &info: mounts) {
+        live.emplace(info.id, 0);
+        by_target[info.target] = info.id;
+    }
+    for (auto &[id, sig]: load_signatures()) {
+        if (auto it = live.find(id); it != live.end())
+            it->second = sig;
+    }
+    for (auto &[target, sig]: pending_signatures) {
+        if (auto it = by_target.find(target); it != by_target.end())
+            live[it->second] = sig;
+    }
+    pending_signatures.clear();
+
+    auto path = signatures_path();
+    xmkdirs(get_magisk_tmp().append("/" INTLROOT).data(), 0700);
+    string tmp = path + ".tmp";
+    auto fp = xopen_file(tmp.data(), "we");
+    if (!fp)
+        return;
+    for (auto &[id, sig]: live) {
+        if (sig)
+            fprintf(fp.get(), "%u %llx\n", id, static_cast<unsigned long long>(sig));
+    }
+    fp.reset();
+    if (rename(tmp.data(), path.data()) != 0) {
+        PLOGE("rename %s", path.data());
+        unlink(tmp.data());
+    }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+class dir_node;
+
+class node_entry;
+
+class node_path_buf;
+
+class root_node;
+
+struct cache_node;
+
+struct cache_writer;
+
+// Holds the signature of the tree of a tmpfs on its root directory
+#define TREE_XATTR "trusted.magic_mount"
+
+// Signatures of the tmpfs trees that could not take TREE_XATTR, such as in a user
+// namespace, by mount id. It is under the Magisk tmp, below the work dir, so it
+// is written once the work dir is detached and outlives the run.
+#define TREE_SIGNATURES INTLROOT "/tree_signatures"
+
+// Tag the tmpfs tree built at worker for target with its signature, in
+// TREE_SIGNATURES if the filesystem does not take TREE_XATTR
+void set_tree_signature(const char *worker, const char *target, uint64_t sig);
+
+// Signature of the tmpfs tree mounted on target with mount id, false if it has none
+bool get_tree_signature(const char *target, unsigned int id, uint64_t &sig);
+
+// Write the signatures set_tree_signature() could not put in TREE_XATTR
+// to TREE_SIGNATURES, after the work dir is detached
+void save_tree_signatures();
+
+// FNV-1a hash of everything the prepared node tree depends on
+struct fingerprint {
+    uint64_t value = 0xcbf29ce484222325ULL;
+
+    void add(const void *data, size_t size) {
+        auto p = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            value ^= p[i];
+            value *= 0x100000001b3ULL;
+        }
+    }
+
+    void add(std::string_view s) {
+        add(s.data(), s.size());
+        add("", 1);
+    }
+
+    // Identity and change times of a file, size and atime are ignored
+    void add(const struct stat &st) {
+        uint64_t v[] = {
+                static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+                static_cast<uint64_t>(st.st_mtim.tv_sec), static_cast<uint64_t>(st.st_mtim.tv_nsec),
+                static_cast<uint64_t>(st.st_ctim.tv_sec), static_cast<uint64_t>(st.st_ctim.tv_nsec),
+        };
+        add(v, sizeof(v));
+    }
+
+    // Identity and modification time only, for files whose attributes mount
+    // changes, such as module files
+    void add_mtime(const struct stat &st) {
+        uint64_t v[] = {
+                static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+                static_cast<uint64_t>(st.st_mtim.tv_sec), static_cast<uint64_t>(st.st_mtim.tv_nsec),
+        };
+        add(v, sizeof(v));
+    }
+};
+
+// On-disk cache of the prepared node tree.
+//
+// The file is a header followed by the nodes in pre-order and a string pool,
+// so it can be mapped and read in place. It is keyed by the fingerprint of the
+// module directories and target partitions, and additionally validated against
+// the stamps of every real directory the tree depends on.
+class tree_cache {
+public:
+    explicit tree_cache(uint64_t key) : key(key) {}
+
+    ~tree_cache();
+
+    // Return the cached tree, or null if the cache is missing or stale.
+    // Strings of the returned tree point into the mapping, so the tree
+    // must not outlive this object.
+    root_node *load(const char *path);
+
+    // Write the prepared tree to path
+    bool save(const char *path, root_node *root);
+
+    // Hash of a prepared subtree, the same for the same mounts and files.
+    // path holds the paths of node, module files are hashed with their identity.
+    static uint64_t signature(node_entry *node, node_path_buf &path);
+
+    // Add the identity of the module file at source to fp, so a file replaced
+    // in a module changes the signature
+    static void add_source(fingerprint &fp, const char *source);
+
+private:
+    node_entry *restore(const cache_node *&it, const cache_node *end,
+                        const char *pool, size_t pool_size);
+
+    static void stamp(dir_node *dir, fingerprint &fp, std::string &path);
+
+    static void serialize(node_entry *node, cache_writer &w);
+
+    static void signature(node_entry *node, node_path_buf &path, fingerprint &fp);
+
+    uint64_t key;
+    void *map = nullptr;
+    size_t map_size = 0;
+};
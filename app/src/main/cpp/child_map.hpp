@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+#include <utility>
+
+#include "arena.hpp"
+
+// Sorted contiguous map from names to child nodes, stored in the current arena.
+//
+// Lookups are a binary search over one array instead of chasing tree nodes.
+// A directory listing is ingested in bulk: entries emplaced between begin_batch()
+// and commit() are appended unsorted, then sorted and merged once. Such entries
+// must have unique names and are not visible to find() until committed.
+// Iterators are plain pointers, they stay valid when a value is replaced in place.
+template<class T>
+class child_map {
+public:
+    // Trivially copyable, so entries can be moved with memmove
+    struct value_type {
+        std::string_view first;
+        T *second;
+    };
+    using iterator = value_type *;
+
+    iterator begin() { return _data; }
+
+    iterator end() { return _data + _size; }
+
+    size_t size() const { return _size; }
+
+    bool empty() const { return _size == 0; }
+
+    void clear() { _size = _sorted = 0; }
+
+    iterator find(std::string_view name) {
+        auto last = _data + _sorted;
+        auto it = lower_bound(name);
+        return it != last && it->first == name ? it : end();
+    }
+
+    std::pair<iterator, bool> emplace(std::string_view name, T *node) {
+        if (_batch) {
+            reserve(_size + 1);
+            _data[_size] = {name, node};
+            return {_data + _size++, true};
+        }
+        auto it = lower_bound(name);
+        if (it != end() && it->first == name)
+            return {it, false};
+        auto pos = it - _data;
+        reserve(_size + 1);
+        memmove(_data + pos + 1, _data + pos, (_size - pos) * sizeof(value_type));
+        _data[pos] = {name, node};
+        ++_size;
+        ++_sorted;
+        return {_data + pos, true};
+    }
+
+    iterator erase(iterator it) {
+        memmove(it, it + 1, (end() - it - 1) * sizeof(value_type));
+        if (it < _data + _sorted)
+            --_sorted;
+        --_size;
+        return it;
+    }
+
+    void begin_batch() { _batch = true; }
+
+    void commit() {
+        _batch = false;
+        if (_sorted == _size)
+            return;
+        auto cmp = [](const value_type &a, const value_type &b) { return a.first < b.first; };
+        std::sort(_data + _sorted, end(), cmp);
+        if (_sorted) {
+            auto merged = allocate(_capacity);
+            std::merge(_data, _data + _sorted, _data + _sorted, end(), merged, cmp);
+            _data = merged;
+        }
+        _sorted = _size;
+    }
+
+    // Move all entries of other into this map, entries of other
+    // with a name already present are dropped
+    void merge(child_map &other) {
+        if (empty()) {
+            std::swap(_data, other._data);
+            std::swap(_size, other._size);
+            std::swap(_sorted, other._sorted);
+            std::swap(_capacity, other._capacity);
+        } else if (!other.empty()) {
+            size_t capacity = _size + other._size;
+            auto merged = allocate(capacity);
+            size_t n = 0;
+            auto a = begin(), b = other.begin();
+            while (a != end() || b != other.end()) {
+                if (b == other.end() || (a != end() && a->first < b->first)) {
+                    merged[n++] = *a++;
+                } else {
+                    if (a != end() && a->first == b->first)
+                        merged[n++] = *a++;
+                    else
+                        merged[n++] = *b;
+                    ++b;
+                }
+            }
+            _data = merged;
+            _size = _sorted = n;
+            _capacity = capacity;
+        }
+        other.clear();
+    }
+
+private:
+    static iterator allocate(size_t n) {
+        return static_cast<iterator>(arena::current()->alloc(n * sizeof(value_type), alignof(value_type)));
+    }
+
+    iterator lower_bound(std::string_view name) {
+        return std::lower_bound(_data, _data + _sorted, name,
+                                [](const value_type &p, std::string_view n) { return p.first < n; });
+    }
+
+    // The old array is abandoned in the arena
+    void reserve(size_t n) {
+        if (n <= _capacity)
+            return;
+        size_t capacity = std::max<size_t>({8, _capacity * 2, n});
+        auto data = allocate(capacity);
+        if (_size)
+            memcpy(data, _data, _size * sizeof(value_type));
+        _data = data;
+        _capacity = capacity;
+    }
+
+    iterator _data = nullptr;
+    size_t _size = 0;
+    size_t _sorted = 0;
+    size_t _capacity = 0;
+    bool _batch = false;
+};
@@ -0,0 +1,382 @@
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <optional>
+
+#include "main.hpp"
+#include "base.hpp"
+#include "node.hpp"
+#include "plan.hpp"
+#include "stats.hpp"
+#include "verify.hpp"
+
+using namespace std;
+using namespace std::string_view_literals;
+
+// Changes that can alter the collected module files. Attributes and contents
+// are not collected, bound files show them as they are.
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// A burst of changes, such as a module being extracted, is waited out
+// for this long before the tree is prepared again
+#define SETTLE_MS 500
+
+// Longest request line
+#define REQUEST_MAX 4096
+
+// A client that stops sending its request or reading the reply is given up
+// after this long, as requests are served one at a time
+#define CLIENT_TIMEOUT_MS 2000
+
+/*************
+ * Watches
+ *************/
+
+// Watch dir, and the directories under it down to depth levels, or all if negative
+static void add_watches(int ifd, string &dir, int depth, size_t &count) {
+    if (inotify_add_watch(ifd, dir.data(), WATCH_MASK | IN_ONLYDIR) < 0) {
+        PLOGE("inotify_add_watch %s", dir.data());
+        return;
+    }
+    count++;
+    if (depth == 0)
+        return;
+    dir_reader d(open(dir.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    while (d.read()) {
+        for (auto entry: d) {
+            if (entry.type != DT_DIR)
+                continue;
+            dir.push_back('/');
+            dir.append(entry.name);
+            add_watches(ifd, dir, depth - 1, count);
+            dir.resize(dir.size() - entry.name.size() - 1);
+        }
+    }
+}
+
+// A new inotify fd watching the modules directory, each module directory
+// for disable and skip_mount, and every directory of their system trees
+static int watch_modules() {
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd < 0) {
+        PLOGE("inotify_init");
+        return -1;
+    }
+    size_t count = 0;
+    string dir(MODULEROOT);
+    add_watches(ifd, dir, 0, count);
+    dir_reader d(open(MODULEROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    while (d.read()) {
+        for (auto entry: d) {
+            if (entry.type != DT_DIR || entry.name == ".core"sv)
+                continue;
+            dir.assign(MODULEROOT "/").append(entry.name);
+            add_watches(ifd, dir, 0, count);
+            dir.append("/system");
+            if (access(dir.data(), F_OK) == 0)
+                add_watches(ifd, dir, -1, count);
+        }
+    }
+    LOGD("daemon: watching %zu directories", count);
+    return ifd;
+}
+
+// Read all pending events, return their number
+static size_t drain_events(int ifd) {
+    alignas(inotify_event) char buf[4096];
+    size_t n = 0;
+    for (;;) {
+        ssize_t len = read(ifd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        for (char *p = buf; p < buf + len; p += sizeof(inotify_event) + reinterpret_cast<inotify_event *>(p)->len)
+            n++;
+    }
+    return n;
+}
+
+/*************
+ * Daemon
+ *************/
+
+namespace {
+
+// The prepared tree and what keeps it up to date
+class module_daemon {
+public:
+    explicit module_daemon(const char *magic) : magic(magic) {}
+
+    ~module_daemon() {
+        if (ifd >= 0)
+            close(ifd);
+    }
+
+    int watch_fd() const { return ifd; }
+
+    // Watch the modules again and prepare a new tree
+    void rebuild();
+
+    // The modules changed, the tree is prepared again when they settle
+    // or when a request needs it first
+    void set_changed() { changed = true; }
+
+    bool is_changed() const { return changed; }
+
+    // Serve the request of a connected client, false to stop the daemon
+    bool serve(int client);
+
+private:
+    // Run a request, the command followed by its options
+    bool run(const vector<string_view> &request, int client);
+
+    const char *magic;
+    int ifd = -1;
+    bool changed = false;
+    // Holds the nodes of the current tree, released when it is rebuilt
+    optional<arena> tree_arena;
+    root_node *root = nullptr;
+    // Targets of umount --pid, found again after the mounts change
+    optional<vector<string>> targets;
+};
+
+void module_daemon::rebuild() {
+    // Watched before collecting, so changes made meanwhile are not missed
+    if (ifd >= 0)
+        close(ifd);
+    ifd = watch_modules();
+    changed = false;
+
+    root = nullptr;
+    tree_arena.reset();
+    tree_arena.emplace();
+    reset_phases();
+    root = prepare_modules();
+    LOGI("daemon: tree prepared, %zu KiB", tree_arena->get_stats().bytes / 1024);
+    log_phases();
+}
+
+bool module_daemon::run(const vector<string_view> &request, int client) {
+    auto command = request[0];
+    vector<int> pids;
+    bool verify = false;
+    for (size_t i = 1; i < request.size(); ++i) {
+        if (request[i] == "--pid"sv && i + 1 < request.size()) {
+            if (!parse_pids(request[++i], pids))
+                return false;
+        } else if (request[i] == "--verify"sv) {
+            verify = true;
+        }
+    }
+
+    // Only needs the mounts, not the tree
+    if (command == "umount"sv && !pids.empty()) {
+        if (!verify && !targets)
+            targets = umount_targets(magic);
+        return umount_pids(pids, verify ? nullptr : &*targets, magic);
+    }
+    if (command == "umount"sv) {
+        targets.reset();
+        umount_modules(magic);
+        return true;
+    }
+
+    // A request always sees the modules as they are
+    if (changed)
+        rebuild();
+    // Reports go to the client
+    auto verify_tree = [&] {
+        auto fp = xopen_file(dup(client), "we");
+        return fp && mount_verifier(fp.get(), magic).run(root);
+    };
+    if (command == "mount"sv) {
+        targets.reset();
+        if (stage_mounts || stats_enabled)
+            track_events();
+        if (!mount_work_dir(magic))
+            return false;
+        mount_tree(root);
+        umount_work_dir();
+        return !verify || verify_tree();
+    } else if (command == "reconcile"sv) {
+        targets.reset();
+        if (stage_mounts || stats_enabled)
+            track_events();
+        return reconcile_tree(root, magic) && (!verify || verify_tree());
+    } else if (command == "verify"sv) {
+        return verify_tree();
+    } else if (command == "plan"sv) {
+        auto fp = xopen_file(dup(client), "we");
+        if (!fp)
+            return false;
+        mount_planner(fp.get()).run(root);
+        return true;
+    }
+    return false;
+}
+
+bool module_daemon::serve(int client) {
+    // Only the user of the daemon may mount
+    ucred cred{};
+    socklen_t len = sizeof(cred);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != getuid()) {
+        LOGW("daemon: request of uid %d refused", cred.uid);
+        return true;
+    }
+    timeval timeout{.tv_sec = CLIENT_TIMEOUT_MS / 1000, .tv_usec = CLIENT_TIMEOUT_MS % 1000 * 1000};
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+        PLOGE("setsockopt");
+        return true;
+    }
+
+    char buf[REQUEST_MAX];
+    size_t size = 0;
+    ssize_t ret;
+    while (size < sizeof(buf) && (ret = read(client, buf + size, sizeof(buf) - size)) > 0) {
+        size += ret;
+        if (memchr(buf, '\n', size))
+            break;
+    }
+    string_view line(buf, size);
+    auto end = line.find('\n');
+    if (end == string_view::npos) {
+        // Timed out, closed early or too long, a part of it is not run
+        LOGW("daemon: incomplete request");
+        return true;
+    }
+    line = line.substr(0, end);
+    vector<string_view> request;
+    for (size_t pos = 0; pos < line.size();) {
+        size_t end = min(line.find(' ', pos), line.size());
+        if (end > pos)
+            request.push_back(line.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    if (request.empty())
+        return true;
+    auto command = request[0];
+    if (command == "stop"sv) {
+        LOGI("daemon: stopping");
+        xwrite(client, "ok\n", 3);
+        return false;
+    }
+
+    // Logged from copies, the request is not terminated in buf
+    string text(line), name(command);
+    LOGI("daemon: %s", text.data());
+    reset_phases();
+    auto start = now_ns();
+    bool ok = run(request, client);
+    LOGI("daemon: %s %s in %.3fms", name.data(), ok ? "done" : "failed", (now_ns() - start) / 1e6);
+    log_phases();
+    log_events();
+    const char *status = ok ? "ok\n" : "error\n";
+    xwrite(client, status, strlen(status));
+    return true;
+}
+
+} // namespace
+
+static bool socket_addr(const char *socket, sockaddr_un &addr) {
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket) >= sizeof(addr.sun_path)) {
+        LOGE("socket path too long: %s", socket);
+        return false;
+    }
+    strcpy(addr.sun_path, socket);
+    return true;
+}
+
+int run_daemon(const char *magic, const char *socket) {
+    sockaddr_un addr{};
+    if (!socket_addr(socket, addr))
+        return 1;
+    int sfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket);
+    if (sfd < 0 || bind(sfd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        chmod(socket, 0600) != 0 || listen(sfd, 8) != 0) {
+        PLOGE("listen %s", socket);
+        if (sfd >= 0)
+            close(sfd);
+        return 1;
+    }
+    // A client leaving early must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    module_daemon daemon(magic);
+    daemon.rebuild();
+    LOGI("daemon: listening on %s", socket);
+
+    for (;;) {
+        pollfd fds[] = {{sfd, POLLIN, 0}, {daemon.watch_fd(), POLLIN, 0}};
+        int n = poll(fds, std::size(fds), daemon.is_changed() ? SETTLE_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            PLOGE("poll");
+            break;
+        }
+        if (n == 0) {
+            // The modules settled
+            daemon.rebuild();
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            size_t events = drain_events(daemon.watch_fd());
+            LOGD("daemon: %zu module changes", events);
+            daemon.set_changed();
+        }
+        if (fds[0].revents & POLLIN) {
+            int client = accept4(sfd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
+                continue;
+            bool keep = daemon.serve(client);
+            close(client);
+            if (!keep)
+                break;
+        }
+    }
+    close(sfd);
+    unlink(socket);
+    return 0;
+}
+
+int send_request(const char *socket, const char *request) {
+    sockaddr_un addr{};
+    if (!socket_addr(socket, addr))
+        return 1;
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        PLOGE("connect %s", socket);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    string line(request);
+    line.push_back('\n');
+    xwrite(fd, line.data(), line.size());
+    shutdown(fd, SHUT_WR);
+
+    // The reply is the output of the command, then ok or error on the last line
+    string reply;
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        reply.append(buf, len);
+    close(fd);
+    if (!reply.empty() && reply.back() == '\n')
+        reply.pop_back();
+    size_t pos = reply.rfind('\n');
+    pos = pos == string::npos ? 0 : pos + 1;
+    fwrite(reply.data(), 1, pos, stdout);
+    fflush(stdout);
+    string_view status = string_view(reply).substr(pos);
+    if (status != "ok"sv) {
+        LOGE("daemon: %s %s", request, status.empty() ? "no reply" : "failed");
+        return 1;
+    }
+    return 0;
+}
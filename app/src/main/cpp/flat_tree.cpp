@@ -0,0 +1,48 @@
+#include <unordered_map>
+
+#include "base.hpp"
+#include "flat_tree.hpp"
+
+using namespace std;
+
+flat_tree::flat_tree(node_entry *root) {
+    // Names of siblings are unique, but modules and common names such as lib repeat
+    unordered_map<string_view, uint32_t> strings;
+    auto add_string = [&](string_view s) {
+        auto [it, added] = strings.try_emplace(s, pool.size());
+        if (added) {
+            pool.append(s);
+            pool.push_back('\0');
+        }
+        return it->second;
+    };
+
+    // Breadth first, so the children of each node are appended together
+    vector<node_entry *> order{root};
+    parents.push_back(npos);
+    for (size_t i = 0; i < order.size(); ++i) {
+        auto node = order[i];
+        names.push_back(add_string(node->_name));
+        auto mn = dyn_cast<module_node>(node);
+        modules.push_back(mn ? add_string(mn->module) : npos);
+        types.push_back(node->_node_type);
+        file_types.push_back(node->_file_type);
+        firsts.push_back(order.size());
+        auto dn = dyn_cast<dir_node>(node);
+        counts.push_back(dn ? dn->children.size() : 0);
+        if (!dn)
+            continue;
+        for (auto &[_, child]: dn->children) {
+            order.push_back(child);
+            parents.push_back(i);
+        }
+    }
+    pool.shrink_to_fit();
+}
+
+size_t flat_tree::memory() const {
+    return names.capacity() * sizeof(uint32_t) + modules.capacity() * sizeof(uint32_t) +
+           parents.capacity() * sizeof(index) + firsts.capacity() * sizeof(index) +
+           counts.capacity() * sizeof(index) + types.capacity() + file_types.capacity() +
+           pool.capacity();
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "node.hpp"
+
+// Structure-of-arrays copy of a prepared node tree, for large trees.
+//
+// Node i is described by the i-th element of each array. Nodes are stored breadth
+// first, so the children of a node are the index range [first, first + count), in
+// the order of the child map. Names and modules are offsets into one string pool.
+// Nodes carry no vtable, walk() dispatches on the node type with a switch.
+class flat_tree {
+public:
+    using index = uint32_t;
+
+    static constexpr index npos = UINT32_MAX;
+
+    // Copy the tree under root, which is node 0
+    explicit flat_tree(node_entry *root);
+
+    size_t size() const { return types.size(); }
+
+    std::string_view name(index i) const { return pool.data() + names[i]; }
+
+    // Module of a module node, null for the others
+    const char *module(index i) const { return modules[i] == npos ? nullptr : pool.data() + modules[i]; }
+
+    index parent(index i) const { return parents[i]; }
+
+    uint8_t node_type(index i) const { return types[i]; }
+
+    uint8_t file_type(index i) const { return file_types[i] & 15; }
+
+    // The file type with the flags node_entry keeps in the high bits
+    uint8_t file_type_bits(index i) const { return file_types[i]; }
+
+    bool exist(index i) const { return file_types[i] & (1 << 7); }
+
+    index first_child(index i) const { return firsts[i]; }
+
+    index child_count(index i) const { return counts[i]; }
+
+    // Bytes of the arrays and the string pool
+    size_t memory() const;
+
+    // Visit every node in pre-order with path holding its path, calling the
+    // member of v for its type: inter, tmpfs, module or root(index, path)
+    template<class Visitor>
+    void walk(Visitor &v, std::string &path, index i = 0) const {
+        switch (types[i]) {
+            case TYPE_INTER:
+                v.inter(i, path);
+                break;
+            case TYPE_TMPFS:
+                v.tmpfs(i, path);
+                break;
+            case TYPE_MODULE:
+                v.module(i, path);
+                return;
+            case TYPE_ROOT:
+                v.root(i, path);
+                break;
+            default:
+                return;
+        }
+        for (index c = firsts[i], end = c + counts[i]; c < end; ++c) {
+            auto n = name(c);
+            path.push_back('/');
+            path.append(n);
+            walk(v, path, c);
+            path.resize(path.size() - n.size() - 1);
+        }
+    }
+
+private:
+    std::vector<uint32_t> names;
+    std::vector<uint32_t> modules;
+    std::vector<index> parents;
+    std::vector<index> firsts;
+    std::vector<index> counts;
+    std::vector<uint8_t> types;
+    std::vector<uint8_t> file_types;
+    std::string pool;
+};
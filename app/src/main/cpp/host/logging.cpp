@@ -0,0 +1,47 @@
+#include <unistd.h>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../logging.h"
+#include "../log_ring.hpp"
+
+// Host stand-in for logging.cpp. stderr takes the place of logcat, messages below
+// the priority in MAGIC_MOUNT_LOG (one of V D I W E F, default D) are dropped.
+
+namespace logging {
+    static char prio_str[] = {
+            'V', 'D', 'I', 'W', 'E', 'F'
+    };
+
+    static int min_prio() {
+        static int prio = [] {
+            const char *env = getenv("MAGIC_MOUNT_LOG");
+            for (int i = 0; env && i < static_cast<int>(sizeof(prio_str)); ++i) {
+                if (env[0] == prio_str[i])
+                    return ANDROID_LOG_VERBOSE + i;
+            }
+            return static_cast<int>(ANDROID_LOG_DEBUG);
+        }();
+        return prio;
+    }
+
+    void setPrintEnabled(bool print) {}
+
+    void write_log(int prio, const char *tag, int tid, const char *msg) {
+        auto prio_char = (prio > ANDROID_LOG_DEFAULT && prio <= ANDROID_LOG_FATAL) ? prio_str[
+                prio - ANDROID_LOG_VERBOSE] : '?';
+        fprintf(stderr, "[%c][%d:%d][%s]:%s\n", prio_char, getpid(), tid, tag, msg);
+    }
+
+    void log(int prio, const char *tag, const char *fmt, ...) {
+        if (prio < min_prio())
+            return;
+        int saved = errno;
+        va_list ap;
+        va_start(ap, fmt);
+        vlog_async(prio, tag, fmt, ap);
+        va_end(ap);
+        errno = saved;
+    }
+}
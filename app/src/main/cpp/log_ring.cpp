@@ -0,0 +1,463 @@
+#include <android/log.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "log_ring.hpp"
+
+namespace logging {
+
+#define RING_SLOTS  512
+#define DATA_SIZE   448
+// How long the consumer waits for more messages before sleeping until woken
+#define POLL_NS     (5 * 1000 * 1000)
+
+// One message. Its arguments are packed in data in the order of the format:
+// numbers and pointers as 8 bytes, and strings, which may be gone by the time
+// the message is formatted, as their 2 byte length followed by their bytes.
+struct alignas(64) record {
+    // Ring position the slot is free for, plus one once filled
+    std::atomic_size_t seq;
+    // Null if the message was written by its producer
+    const char *fmt;
+    const char *tag;
+    int tid;
+    int prio;
+    char data[DATA_SIZE];
+};
+
+enum : uint32_t {
+    RUNNING,
+    POLL,   // waiting with a timeout, producers do not wake it
+    IDLE,   // waiting until a producer wakes it
+};
+
+static record ring[RING_SLOTS];
+alignas(64) static std::atomic_size_t head;
+alignas(64) static std::atomic_size_t tail;
+alignas(64) static std::atomic_uint32_t state;
+static std::atomic_bool stopping;
+// Set by flush() until resume(), messages are written synchronously meanwhile
+static std::atomic_bool paused;
+// Producers between the paused check and publishing their slot
+static std::atomic_int producers;
+static std::atomic_bool ring_ready;
+static std::once_flag started;
+static std::mutex pause_lock;
+static std::thread consumer;
+
+enum arg_len : uint8_t {
+    LEN_INT,
+    LEN_LONG,
+    LEN_LLONG,
+    LEN_SIZE,
+    LEN_INTMAX,
+    LEN_PTRDIFF,
+    LEN_LDOUBLE,
+};
+
+struct conv_spec {
+    bool star_width;
+    bool star_prec;
+    // Literal precision, -1 if none or given by an argument
+    int prec;
+    arg_len len;
+    char conv;
+};
+
+// Parse the conversion after a '%', return where it ends
+static const char *parse_spec(const char *p, conv_spec &s) {
+    s = {};
+    s.prec = -1;
+    p += strspn(p, "-+ #0");
+    if (*p == '*') {
+        s.star_width = true;
+        ++p;
+    } else {
+        while (isdigit(*p)) ++p;
+    }
+    if (*p == '.') {
+        if (*++p == '*') {
+            s.star_prec = true;
+            ++p;
+        } else {
+            s.prec = 0;
+            while (isdigit(*p))
+                s.prec = s.prec * 10 + (*p++ - '0');
+        }
+    }
+    switch (*p) {
+        case 'h':
+            // Promoted to int
+            p += p[1] == 'h' ? 2 : 1;
+            break;
+        case 'l':
+            s.len = p[1] == 'l' ? LEN_LLONG : LEN_LONG;
+            p += p[1] == 'l' ? 2 : 1;
+            break;
+        case 'q': s.len = LEN_LLONG; ++p; break;
+        case 'z': s.len = LEN_SIZE; ++p; break;
+        case 'j': s.len = LEN_INTMAX; ++p; break;
+        case 't': s.len = LEN_PTRDIFF; ++p; break;
+        case 'L': s.len = LEN_LDOUBLE; ++p; break;
+    }
+    s.conv = *p;
+    return *p ? p + 1 : p;
+}
+
+class packer {
+public:
+    explicit packer(char *data) : data(data) {}
+
+    bool put(const void *v, size_t n) {
+        if (len + n > DATA_SIZE)
+            return false;
+        memcpy(data + len, v, n);
+        len += n;
+        return true;
+    }
+
+    bool put_num(uint64_t v) { return put(&v, sizeof(v)); }
+
+    // Copy at most prec bytes of s, all of it if prec is negative
+    bool put_str(const char *s, int prec) {
+        if (!s)
+            s = "(null)";
+        size_t n = prec < 0 ? strlen(s) : strnlen(s, prec);
+        if (len + sizeof(uint16_t) + n > DATA_SIZE)
+            return false;
+        auto n16 = static_cast<uint16_t>(n);
+        return put(&n16, sizeof(n16)) && put(s, n);
+    }
+
+private:
+    char *data;
+    size_t len = 0;
+};
+
+class unpacker {
+public:
+    explicit unpacker(const char *data) : data(data) {}
+
+    uint64_t num() {
+        uint64_t v;
+        memcpy(&v, data, sizeof(v));
+        data += sizeof(v);
+        return v;
+    }
+
+    double dbl() {
+        double v;
+        memcpy(&v, data, sizeof(v));
+        data += sizeof(v);
+        return v;
+    }
+
+    // Copy the next string to buf, which holds DATA_SIZE + 1 bytes
+    const char *str(char *buf) {
+        uint16_t n;
+        memcpy(&n, data, sizeof(n));
+        memcpy(buf, data + sizeof(n), n);
+        buf[n] = '\0';
+        data += sizeof(n) + n;
+        return buf;
+    }
+
+private:
+    const char *data;
+};
+
+static uint64_t get_int(va_list *ap, arg_len len) {
+    switch (len) {
+        case LEN_LONG: return va_arg(*ap, long);
+        case LEN_LLONG: return va_arg(*ap, long long);
+        case LEN_SIZE: return va_arg(*ap, size_t);
+        case LEN_INTMAX: return va_arg(*ap, intmax_t);
+        case LEN_PTRDIFF: return va_arg(*ap, ptrdiff_t);
+        default: return va_arg(*ap, int);
+    }
+}
+
+static int print_int(char *buf, size_t size, const char *spec, arg_len len, uint64_t v) {
+    switch (len) {
+        case LEN_LONG: return snprintf(buf, size, spec, static_cast<long>(v));
+        case LEN_LLONG: return snprintf(buf, size, spec, static_cast<long long>(v));
+        case LEN_SIZE: return snprintf(buf, size, spec, static_cast<size_t>(v));
+        case LEN_INTMAX: return snprintf(buf, size, spec, static_cast<intmax_t>(v));
+        case LEN_PTRDIFF: return snprintf(buf, size, spec, static_cast<ptrdiff_t>(v));
+        default: return snprintf(buf, size, spec, static_cast<int>(v));
+    }
+}
+
+// Copy the arguments of fmt into data. False if they do not fit
+// or a conversion is not supported.
+static bool pack(const char *fmt, va_list *ap, char *data) {
+    packer out(data);
+    for (const char *p = fmt; (p = strchr(p, '%'));) {
+        conv_spec s;
+        p = parse_spec(p + 1, s);
+        if (s.conv == '%')
+            continue;
+        if (s.star_width && !out.put_num(va_arg(*ap, int)))
+            return false;
+        if (s.star_prec) {
+            s.prec = va_arg(*ap, int);
+            if (!out.put_num(s.prec))
+                return false;
+        }
+        bool ok;
+        switch (s.conv) {
+            case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+                ok = out.put_num(get_int(ap, s.len));
+                break;
+            case 'p':
+                ok = out.put_num(reinterpret_cast<uintptr_t>(va_arg(*ap, void *)));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                if (s.len == LEN_LDOUBLE)
+                    return false;
+                double d = va_arg(*ap, double);
+                ok = out.put(&d, sizeof(d));
+                break;
+            }
+            case 's':
+                if (s.len != LEN_INT)
+                    return false;
+                ok = out.put_str(va_arg(*ap, const char *), s.prec);
+                break;
+            default:
+                return false;
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// Format a record packed by pack() into buf
+static void format(const record &r, char *buf, size_t size) {
+    unpacker in(r.data);
+    char str[DATA_SIZE + 1];
+    size_t pos = 0;
+    auto append = [&](int n) {
+        if (n > 0)
+            pos = std::min(pos + n, size - 1);
+    };
+    for (const char *p = r.fmt; *p && pos < size - 1;) {
+        const char *pct = strchr(p, '%');
+        size_t n = std::min(pct ? static_cast<size_t>(pct - p) : strlen(p), size - 1 - pos);
+        memcpy(buf + pos, p, n);
+        pos += n;
+        if (!pct)
+            break;
+
+        conv_spec s;
+        p = parse_spec(pct + 1, s);
+        // The conversion with * replaced by the packed width and precision
+        char spec[64];
+        size_t len = 0;
+        for (const char *q = pct; q < p && len < sizeof(spec) - 16; ++q) {
+            if (*q != '*') {
+                spec[len++] = *q;
+                continue;
+            }
+            int v = static_cast<int>(in.num());
+            // A negative precision is taken as none
+            if (q[-1] == '.' && v < 0)
+                len--;
+            else
+                len += snprintf(spec + len, sizeof(spec) - len, "%d", v);
+        }
+        spec[len] = '\0';
+
+        char *out = buf + pos;
+        size_t left = size - pos;
+        switch (s.conv) {
+            case '%':
+                append(snprintf(out, left, "%%"));
+                break;
+            case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+                append(print_int(out, left, spec, s.len, in.num()));
+                break;
+            case 'p':
+                append(snprintf(out, left, spec, reinterpret_cast<void *>(static_cast<uintptr_t>(in.num()))));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                append(snprintf(out, left, spec, in.dbl()));
+                break;
+            case 's':
+                append(snprintf(out, left, spec, in.str(str)));
+                break;
+        }
+    }
+    buf[pos] = '\0';
+}
+
+static int current_tid() {
+    static thread_local int tid = gettid();
+    return tid;
+}
+
+static void write_sync(int prio, const char *tag, const char *fmt, va_list ap) {
+    char buf[BUFSIZ];
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    write_log(prio, tag, current_tid(), buf);
+}
+
+static void wake() {
+    if (state.exchange(RUNNING) != RUNNING)
+        syscall(__NR_futex, &state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+static bool pending() {
+    size_t pos = head.load(std::memory_order_relaxed);
+    return ring[pos % RING_SLOTS].seq.load(std::memory_order_acquire) == pos + 1;
+}
+
+// Write out the filled records in order, return how many
+static size_t drain() {
+    char buf[BUFSIZ];
+    size_t pos = head.load(std::memory_order_relaxed);
+    size_t n = 0;
+    for (;; ++pos, ++n) {
+        auto &r = ring[pos % RING_SLOTS];
+        if (r.seq.load(std::memory_order_acquire) != pos + 1)
+            break;
+        if (r.fmt) {
+            format(r, buf, sizeof(buf));
+            write_log(r.prio, r.tag, r.tid, buf);
+        }
+        r.seq.store(pos + RING_SLOTS, std::memory_order_release);
+        head.store(pos + 1, std::memory_order_release);
+    }
+    return n;
+}
+
+static void run() {
+    for (;;) {
+        // Keep polling while messages come in, sleep once a poll found nothing
+        uint32_t wait = drain() ? POLL : IDLE;
+        state.store(wait);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (stopping.load()) {
+            drain();
+            return;
+        }
+        if (!pending()) {
+            timespec ts{.tv_sec = 0, .tv_nsec = POLL_NS};
+            syscall(__NR_futex, &state, FUTEX_WAIT_PRIVATE, wait, wait == POLL ? &ts : nullptr, nullptr, 0);
+        }
+        state.store(RUNNING, std::memory_order_relaxed);
+    }
+}
+
+static void start() {
+    for (size_t i = 0; i < RING_SLOTS; ++i)
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    consumer = std::thread(run);
+    ring_ready = true;
+    atexit(flush);
+}
+
+void flush() {
+    std::lock_guard g(pause_lock);
+    if (paused.exchange(true))
+        return;
+    // Producers that got in before the pause finish their slot first. The
+    // consumer is still running, as one may be waiting for it to catch up.
+    while (producers.load() > 0) {
+        wake();
+        sched_yield();
+    }
+    if (consumer.joinable()) {
+        stopping = true;
+        wake();
+        consumer.join();
+        stopping = false;
+    }
+    // Messages queued while the consumer was stopping
+    drain();
+}
+
+void resume() {
+    std::lock_guard g(pause_lock);
+    if (!paused.load())
+        return;
+    if (ring_ready.load() && !consumer.joinable()) {
+        state.store(RUNNING);
+        consumer = std::thread(run);
+    }
+    paused.store(false);
+}
+
+void vlog_async(int prio, const char *tag, const char *fmt, va_list ap) {
+    if (prio >= ANDROID_LOG_FATAL)
+        flush();
+    // Counted before the check, so flush() either sees this producer or
+    // this producer sees the pause
+    producers.fetch_add(1);
+    if (paused.load()) {
+        producers.fetch_sub(1);
+        // After the messages flush() is still writing out
+        std::lock_guard g(pause_lock);
+        write_sync(prio, tag, fmt, ap);
+        return;
+    }
+    std::call_once(started, start);
+
+    size_t pos = tail.load(std::memory_order_relaxed);
+    record *r;
+    for (;;) {
+        r = &ring[pos % RING_SLOTS];
+        auto diff = static_cast<ptrdiff_t>(r->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // Full, let the consumer catch up
+            wake();
+            sched_yield();
+            pos = tail.load(std::memory_order_relaxed);
+        } else {
+            pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    r->fmt = fmt;
+    r->tag = tag;
+    r->tid = current_tid();
+    r->prio = prio;
+    va_list args;
+    va_copy(args, ap);
+    bool packed = pack(fmt, &args, r->data);
+    va_end(args);
+    if (!packed) {
+        // Too long for a slot, or not supported. Wait for the messages
+        // queued before and write it from here.
+        while (head.load(std::memory_order_acquire) != pos) {
+            wake();
+            sched_yield();
+        }
+        write_sync(prio, tag, fmt, ap);
+        r->fmt = nullptr;
+    }
+    r->seq.store(pos + 1, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto s = state.load(std::memory_order_relaxed);
+    if (s == IDLE || (s == POLL && pos - head.load(std::memory_order_relaxed) >= RING_SLOTS / 2))
+        wake();
+    producers.fetch_sub(1, std::memory_order_release);
+}
+
+}
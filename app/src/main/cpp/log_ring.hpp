@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdarg>
+
+// Asynchronous backend of logging::log(). Callers only copy the format pointer
+// and the arguments into a lock-free ring, a background thread formats them and
+// hands the messages to write_log() in order. Queued messages are written at exit.
+namespace logging {
+    void vlog_async(int prio, const char *tag, const char *fmt, va_list ap);
+
+    // Write out every queued message and stop the background thread,
+    // messages logged later are written synchronously until resume()
+    void flush();
+
+    // Start the background thread again after flush()
+    void resume();
+
+    // Sink of formatted messages, defined by logging.cpp
+    void write_log(int prio, const char *tag, int tid, const char *msg);
+}
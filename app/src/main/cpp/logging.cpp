@@ -4,6 +4,7 @@
 #include <string>
 
 #include "logging.h"
+#include "log_ring.hpp"
 
 namespace logging {
     static bool use_print = false;
@@ -15,22 +16,21 @@ namespace logging {
         use_print = print;
     }
 
-    void log(int prio, const char *tag, const char *fmt, ...) {
-        {
-            va_list ap;
-            va_start(ap, fmt);
-            __android_log_vprint(prio, tag, fmt, ap);
-            va_end(ap);
-        }
+    void write_log(int prio, const char *tag, int tid, const char *msg) {
+        __android_log_write(prio, tag, msg);
         if (use_print) {
-            char buf[BUFSIZ];
-            va_list ap;
-            va_start(ap, fmt);
-            vsnprintf(buf, sizeof(buf), fmt, ap);
-            va_end(ap);
             auto prio_char = (prio > ANDROID_LOG_DEFAULT && prio <= ANDROID_LOG_FATAL) ? prio_str[
                     prio - ANDROID_LOG_VERBOSE] : '?';
-            printf("[%c][%d:%d][%s]:%s\n", prio_char, getpid(), gettid(), tag, buf);
+            printf("[%c][%d:%d][%s]:%s\n", prio_char, getpid(), tid, tag, msg);
         }
     }
-}
\ No newline at end of file
+
+    void log(int prio, const char *tag, const char *fmt, ...) {
+        int saved = errno;
+        va_list ap;
+        va_start(ap, fmt);
+        vlog_async(prio, tag, fmt, ap);
+        va_end(ap);
+        errno = saved;
+    }
+}
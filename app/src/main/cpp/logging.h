@@ -25,6 +25,15 @@
 namespace logging {
     void setPrintEnabled(bool print);
 
+    // Messages are formatted later on a background thread, so fmt and tag must
+    // outlive the process, as string literals do. String arguments are copied.
     [[gnu::format(printf, 3, 4)]]
     void log(int prio, const char *tag, const char *fmt, ...);
+
+    // Write out the queued messages and stop the background thread, for code that
+    // needs a single threaded process. Later messages are written synchronously.
+    void flush();
+
+    // Queue messages on the background thread again after flush()
+    void resume();
 }
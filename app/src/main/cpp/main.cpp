@@ -1,7 +1,11 @@
 #include <sys/mount.h>
+#include <unistd.h>
 
 #include "main.hpp"
+#include "base.hpp"
+#include "cache.hpp"
 #include "logging.h"
+#include "stats.hpp"
 
 std::string tmp_path = "/debug_ramdisk";
 
@@ -9,8 +13,22 @@ using namespace std::string_view_literals;
 
 std::vector<std::string> partitions{"/vendor", "/product", "/system_ext"};
 
+int jobs = 1;
+
+std::string cache_path;
+
+bool new_mount_api = false;
+
+bool use_overlay = false;
+
+bool optimize_tree = false;
+
+bool stage_mounts = false;
+
+bool verify_mounts = false;
+
 void help() {
-    LOGE("usage: magic_mount <mount|umount> [--work-dir dir] [--magic magic] [--add-partitions /p1,/p2,....]");
+    LOGE("usage: magic_mount <mount|umount|reconcile|plan|verify|daemon|stop> [--work-dir dir] [--magic magic] [--add-partitions /p1,/p2,....] [--jobs n] [--cache file] [--new-mount-api] [--overlay] [--optimize] [--stage] [--stats file] [--socket path] [--pid pid1,pid2,...] [--verify]");
 }
 
 int main(int argc, char **argv) {
@@ -19,6 +37,10 @@ int main(int argc, char **argv) {
 #endif
 
     const char *magic = "magic";
+    const char *stats_path = nullptr;
+    const char *socket_path = nullptr;
+    const char *pid_list = nullptr;
+    std::vector<int> pids;
 
     if (argc < 2) {
         help();
@@ -26,10 +48,26 @@ int main(int argc, char **argv) {
     }
 
     bool do_umount = false;
+    bool do_reconcile = false;
+    bool do_plan = false;
+    bool do_verify = false;
+    bool do_daemon = false;
 
     if (argv[1] == "umount"sv) {
         do_umount = true;
-    } else if (argv[1] != "mount"sv) {
+    } else if (argv[1] == "reconcile"sv) {
+        do_reconcile = true;
+    } else if (argv[1] == "plan"sv) {
+        do_plan = true;
+        // stdout carries the plan
+        logging::setPrintEnabled(false);
+    } else if (argv[1] == "verify"sv) {
+        do_verify = true;
+        // stdout carries the report
+        logging::setPrintEnabled(false);
+    } else if (argv[1] == "daemon"sv) {
+        do_daemon = true;
+    } else if (argv[1] != "mount"sv && argv[1] != "stop"sv) {
         help();
         return 1;
     }
@@ -52,36 +90,113 @@ int main(int argc, char **argv) {
                 break;
             }
             partitions.emplace_back(ps.substr(pos));
+        } else if (argv[i] == "--jobs"sv && i + 1 < argc) {
+            jobs = atoi(argv[i + 1]);
+            if (jobs <= 0)
+                jobs = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+        } else if (argv[i] == "--cache"sv && i + 1 < argc) {
+            cache_path = argv[i + 1];
+        } else if (argv[i] == "--new-mount-api"sv) {
+            new_mount_api = true;
+        } else if (argv[i] == "--overlay"sv) {
+            use_overlay = true;
+        } else if (argv[i] == "--optimize"sv) {
+            optimize_tree = true;
+        } else if (argv[i] == "--stage"sv) {
+            stage_mounts = true;
+        } else if (argv[i] == "--stats"sv && i + 1 < argc) {
+            stats_path = argv[i + 1];
+            stats_enabled = true;
+        } else if (argv[i] == "--socket"sv && i + 1 < argc) {
+            socket_path = argv[i + 1];
+        } else if (argv[i] == "--pid"sv && i + 1 < argc) {
+            pid_list = argv[i + 1];
+            if (!parse_pids(pid_list, pids)) {
+                help();
+                return 1;
+            }
+        } else if (argv[i] == "--verify"sv) {
+            verify_mounts = true;
         }
     }
 
+    // The daemon runs the command with its own options
+    if (!do_daemon && (socket_path || argv[1] == "stop"sv)) {
+        std::string request(argv[1]);
+        if (pid_list)
+            request.append(" --pid ").append(pid_list);
+        if (verify_mounts)
+            request.append(" --verify");
+        return send_request(socket_path ? socket_path : DAEMON_SOCKET, request.data());
+    }
+
+    // Log the phases and write the stats on every return from here
+    run_finally report([&] {
+        log_phases();
+        log_events();
+        if (stats_path)
+            write_stats(stats_path, argv[1]);
+    });
+
+    if (do_umount && !pids.empty()) {
+        // Found once for all processes unless verified with the table of each
+        auto targets = verify_mounts ? std::vector<std::string>() : umount_targets(magic);
+        return umount_pids(pids, verify_mounts ? nullptr : &targets, magic) ? 0 : 1;
+    }
     if (do_umount) {
         umount_modules(magic);
         return 0;
     }
 
-    LOGI("magic_mount: work dir %s magic %s", tmp_path.c_str(), magic);
+    LOGI("magic_mount: work dir %s magic %s jobs %d mount api %s%s", tmp_path.c_str(), magic, jobs,
+         new_mount_api ? "new" : "legacy", use_overlay ? " overlay" : "");
     for (auto &s: partitions) {
         LOGD("supported partitions: %s", s.c_str());
     }
 
+    if (do_daemon)
+        return run_daemon(magic, socket_path ? socket_path : DAEMON_SOCKET);
+    if (do_plan) {
+        plan_modules();
+        return 0;
+    }
+    if (do_verify)
+        return verify_modules(magic) ? 0 : 1;
+    if (stage_mounts || stats_enabled)
+        track_events();
+    if (do_reconcile)
+        return reconcile_modules(magic) ? 0 : 1;
+
+    if (!mount_work_dir(magic))
+        return 1;
+    bool ok = handle_modules(magic);
+    LOGI("mount done");
+    umount_work_dir();
+    return ok ? 0 : 1;
+}
+
+bool mount_work_dir(const char *magic) {
     if (mount(magic, tmp_path.c_str(), "tmpfs", 0, nullptr) == -1) {
         PLOGE("mount tmp");
-        return 1;
+        return false;
     }
+    count_attach(tmp_path.c_str());
     if (mount(nullptr, tmp_path.c_str(), nullptr, MS_PRIVATE, nullptr) == -1) {
         PLOGE("mount tmp private");
-        return 1;
+        return false;
     }
-    handle_modules();
-    LOGI("mount done");
+    return true;
+}
+
+void umount_work_dir() {
+    phase_timer t(PHASE_REMOUNT_RO);
     if (mount(nullptr, tmp_path.c_str(), nullptr, MS_REMOUNT | MS_RDONLY, nullptr) == -1) {
         PLOGE("make ro");
     }
     if (umount2(tmp_path.c_str(), MNT_DETACH) == -1) {
         PLOGE("umount tmp");
     }
-    return 0;
+    save_tree_signatures();
 }
 
 std::string get_magisk_tmp() {
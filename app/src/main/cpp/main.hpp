@@ -3,10 +3,74 @@
 #include <string>
 #include <vector>
 
+class root_node;
+
+// Where the daemon listens by default
+#define DAEMON_SOCKET "/dev/magic_mount"
+
 std::string get_magisk_tmp();
 
-void handle_modules();
+// Mount the modules, false if verified and not all mounts are in place
+bool handle_modules(const char *magic);
 
 void umount_modules(const char *magic);
 
+// The magic mounts umount_modules would detach, in order
+std::vector<std::string> umount_targets(const char *magic);
+
+// Detach targets in the mount namespace of each of pids, or if null, the magic
+// mounts found in the mount table of each. False if a namespace was not entered.
+bool umount_pids(const std::vector<int> &pids, const std::vector<std::string> *targets, const char *magic);
+
+// Mount or detach only what differs from the mounts a fresh mount would make
+bool reconcile_modules(const char *magic);
+
+// Print what mount would do for every node and its estimated cost, without mounting
+void plan_modules();
+
+// Check that the mounts a fresh mount would make are in place, see mount_verifier
+bool verify_modules(const char *magic);
+
+// Collect module files and prepare the tree mount would make as if nothing was
+// mounted yet. Nodes are allocated from the current arena.
+root_node *prepare_modules();
+
+// Mount a prepared tree, the work dir must be mounted
+void mount_tree(root_node *root);
+
+// reconcile_modules with a prepared tree
+bool reconcile_tree(root_node *root, const char *magic);
+
+// Keep the prepared tree up to date with the modules and serve requests on socket
+int run_daemon(const char *magic, const char *socket);
+
+// Have the daemon listening on socket run request, a command and its options,
+// return the exit status
+int send_request(const char *socket, const char *request);
+
+// The tmpfs the worker dirs are populated in, mounted with magic as source
+bool mount_work_dir(const char *magic);
+
+void umount_work_dir();
+
 extern std::vector<std::string> partitions;
+
+extern int jobs;
+
+extern std::string cache_path;
+
+extern bool new_mount_api;
+
+extern bool use_overlay;
+
+extern bool optimize_tree;
+
+extern bool stage_mounts;
+
+extern bool verify_mounts;
+
+// Count the mounts attached on the real filesystem from now on, see event_stats
+void track_events();
+
+// A mount is attached at target on the real filesystem
+void count_attach(const char *target);
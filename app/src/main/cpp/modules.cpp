@@ -1,12 +1,21 @@
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/mount.h>
+#include <sched.h>
+#include <algorithm>
 #include <map>
+#include <unordered_map>
 #include <utility>
 
 #include "main.hpp"
 #include "base.hpp"
 #include "node.hpp"
+#include "cache.hpp"
+#include "umount.hpp"
+#include "plan.hpp"
+#include "optimize.hpp"
+#include "verify.hpp"
+#include "stats.hpp"
 
 using namespace std;
 
@@ -18,251 +27,988 @@ static int bind_mount(const char *reason, const char *from, const char *to, bool
     return ret;
 }
 
+/***************
+ * Mount Events
+ ***************/
+
+// Mounts of the real filesystem when the run started
+static vector<mount_info> real_mounts;
+
+void track_events() {
+    real_mounts = parse_mount_info("self");
+    events = {};
+    events.tracked = true;
+    // Every process of a namespace links to the same inode
+    vector<ino_t> ns;
+    dir_reader proc(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    char buf[64];
+    while (proc.read()) {
+        for (auto entry: proc) {
+            struct stat st{};
+            if (entry.name[0] < '1' || entry.name[0] > '9')
+                continue;
+            snprintf(buf, sizeof(buf), "/proc/%s/ns/mnt", entry.name.data());
+            if (stat(buf, &st) == 0)
+                ns.push_back(st.st_ino);
+        }
+    }
+    sort(ns.begin(), ns.end());
+    events.namespaces = unique(ns.begin(), ns.end()) - ns.begin();
+}
+
+void count_attach(const char *target) {
+    if (!events.tracked)
+        return;
+    // The mount attached under is the last one mounted on the longest prefix of target
+    string_view t(target);
+    const mount_info *under = nullptr;
+    for (auto &m: real_mounts) {
+        string_view mt(m.target);
+        if (t.starts_with(mt) && (mt == "/" || t.size() == mt.size() || t[mt.size()] == '/') &&
+            (!under || mt.size() >= under->target.size()))
+            under = &m;
+    }
+    events.attached++;
+    if (under && under->optional.shared)
+        events.propagated++;
+}
+
 /*************************
  * Node Tree Construction
  *************************/
 
-tmpfs_node::tmpfs_node(node_entry *node) : dir_node(node, this) {
-    if (!replace()) {
-        if (auto dir = open_dir(node_path().data())) {
-            set_exist(true);
-            for (dirent *entry; (entry = xreaddir(dir.get()));) {
+tmpfs_node::tmpfs_node(node_entry *node, int dfd) : dir_node(node, this) {
+    dir_reader dir(replace() ? -1 : count_call(STAT_OPEN, [&] {
+        return openat(dfd, name().data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }));
+    if (dir.fd() >= 0) {
+        set_exist(true);
+        children.begin_batch();
+        while (dir.read()) {
+            for (auto entry: dir) {
                 // create a dummy inter_node to upgrade later
-                emplace<inter_node>(entry->d_name, entry);
+                emplace<inter_node>(entry.name, entry);
             }
         }
+        children.commit();
     }
 
     for (auto it = children.begin(); it != children.end(); ++it) {
         // Upgrade resting inter_node children to tmpfs_node
         if (isa<inter_node>(it->second))
-            it = upgrade<tmpfs_node>(it);
+            it = upgrade<tmpfs_node>(it, dir.fd());
     }
 }
 
 bool dir_node::prepare() {
-    // If direct replace or not exist, mount ourselves as tmpfs
-    bool upgrade_to_tmpfs = replace() || !exist();
-
-    for (auto it = children.begin(); it != children.end();) {
-        // We also need to upgrade to tmpfs node if any child:
-        // - Target does not exist
-        // - Source or target is a symlink (since we cannot bind mount symlink)
-        bool cannot_mnt;
-        if (struct stat st{}; lstat(it->second->node_path().data(), &st) != 0) {
-            cannot_mnt = true;
+    int dfd = open(_parent ? peek_node_path().data() : "/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    bool ret = prepare(dfd);
+    if (dfd >= 0)
+        close(dfd);
+    return ret;
+}
+
+bool dir_node::prepare_under_mounts() {
+    vector<int> fds;
+    string path;
+    for (auto &[name, node]: children) {
+        path.assign("/").append(name);
+        int dfd = open_under_mounts(path.data());
+        if (dfd < 0) {
+            for (int fd: fds)
+                close(fd);
+            return false;
+        }
+        fds.push_back(dfd);
+    }
+    // Partitions are independent subtrees, prepared on the same pool as their directories
+    task_pool pool(jobs);
+    vector<prepare_job> top(fds.size());
+    for (size_t i = 0; i < fds.size(); ++i) {
+        auto &job = top[i];
+        job.dir = static_cast<dir_node *>((children.begin() + i)->second);
+        job.dfd = fds[i];
+        pool.spawn([&job, &pool] { job.dir->prepare(job, pool); });
+    }
+    pool.run();
+    for (int fd: fds)
+        close(fd);
+    return true;
+}
+
+void dir_node::stage(bool under_mounts) {
+    string path;
+    for (auto &[name, node]: children) {
+        path.assign("/").append(name);
+        int dfd = under_mounts ? open_under_mounts(path.data())
+                               : open(path.data(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (dfd < 0)
+            continue;
+        static_cast<dir_node *>(node)->stage(dfd);
+        close(dfd);
+    }
+}
+
+void dir_node::stage(int dfd) {
+    string suffix;
+    // A tmpfs only shows module files, directories and symlinks
+    auto shown = [](node_entry *node) {
+        return !isa<module_node>(node) || node->is_reg() || node->is_dir() || node->is_lnk();
+    };
+    for (auto it = children.begin(); it != children.end(); ++it) {
+        auto dn = dyn_cast<inter_node>(it->second);
+        if (!dn)
+            continue;
+        size_t n = dn->attach_count();
+        if (n > 1 && walk(dn, suffix, shown)) {
+            LOGD("stage: %s, %zu mounts attached as one", dn->peek_node_path().data(), n);
+            it = upgrade<tmpfs_node>(it, dfd);
+        }
+    }
+}
+
+size_t dir_node::attach_count() {
+    if (!isa<inter_node>(this))
+        return 1;
+    size_t n = 0;
+    for (auto &[_, node]: children)
+        n += isa<dir_node>(node) ? static_cast<dir_node *>(node)->attach_count() : 1;
+    return n;
+}
+
+void dir_node::collect_mounts(node_path_buf &path, vector<mount_op> &ops) {
+    for (auto &[name, node]: children) {
+        path.push(name);
+        if (auto tn = dyn_cast<tmpfs_node>(node)) {
+            auto &op = ops.emplace_back(mount_op{tn, path.real(), "", tree_cache::signature(tn, path)});
+            if (use_overlay)
+                tn->overlay_options(op.target, op.overlay);
+        } else if (auto mn = dyn_cast<module_node>(node)) {
+            ops.push_back({mn, path.real(), mn->source(path), 0});
         } else {
-            it->second->set_exist(true);
-            cannot_mnt = it->second->is_lnk() || S_ISLNK(st.st_mode);
+            static_cast<dir_node *>(node)->collect_mounts(path, ops);
         }
+        path.pop(name);
+    }
+}
+
+bool dir_node::prepare(int dfd) {
+    // Subtrees are independent, so each directory is a task on the pool.
+    // Children only change their own subtree and slot, and the results are
+    // applied in order afterwards, so the tree is the same as with one thread.
+    task_pool pool(jobs);
+    prepare_job job;
+    job.dir = this;
+    job.dfd = dfd;
+    pool.spawn([&] { prepare(job, pool); });
+    pool.run();
+    return job.upgrade;
+}
 
-        if (cannot_mnt) {
-            if (_node_type > type_id<tmpfs_node>()) {
+void dir_node::prepare(prepare_job &job, task_pool &pool) {
+    // If direct replace or not exist, mount ourselves as tmpfs
+    job.upgrade = replace() || !exist();
+    job.results.resize(children.size());
+    for (size_t i = 0; i < children.size(); ++i)
+        job.results[i] = prepare_child(children.begin() + i, job, pool);
+    if (job.left.fetch_sub(1) == 1)
+        finish_prepare(&job);
+}
+
+void dir_node::finish_prepare(prepare_job *job) {
+    // Walk up while this is the last job to finish among its siblings
+    for (;;) {
+        auto dir = job->dir;
+        auto it = dir->children.begin();
+        for (auto result: job->results) {
+            if (result == CHILD_UNSUPPORTED) {
                 // Upgrade will fail, remove the unsupported child node
-                LOGW("Unable to add: %s, skipped", it->second->node_path().data());
-                delete it->second;
-                it = children.erase(it);
+                LOGW("Unable to add: %s, skipped", it->second->peek_node_path().data());
+                it = dir->children.erase(it);
                 continue;
             }
-            upgrade_to_tmpfs = true;
+            if (result == CHILD_CANNOT_MOUNT)
+                job->upgrade = true;
+            ++it;
         }
-        if (auto dn = dyn_cast<dir_node>(it->second)) {
-            if (replace()) {
-                // Propagate skip mirror state to all children
-                dn->set_replace(true);
-            }
-            if (dn->prepare()) {
-                // Upgrade child to tmpfs
-                it = upgrade<tmpfs_node>(it);
-            }
+        auto parent = job->parent;
+        if (!parent)
+            return;
+        if (job->dfd >= 0)
+            close(job->dfd);
+        if (job->upgrade) {
+            // Upgrade child to tmpfs, in place
+            parent->dir->upgrade<tmpfs_node>(job->slot, parent->dfd);
         }
-        ++it;
+        delete job;
+        if (parent->left.fetch_sub(1) != 1)
+            return;
+        job = parent;
     }
-    return upgrade_to_tmpfs;
+}
+
+dir_node::child_result dir_node::prepare_child(iterator it, prepare_job &job, task_pool &pool) {
+    int dfd = job.dfd;
+    auto node = it->second;
+    auto dn = dyn_cast<dir_node>(node);
+
+    // A real directory is opened right away, which also tells it exists
+    // and is not a symlink. Anything else only needs its file type.
+    int cfd = -1;
+    mode_t mode;
+    bool found;
+    if (dn && (cfd = count_call(STAT_OPEN, [&] {
+        return openat(dfd, node->name().data(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    })) >= 0) {
+        found = true;
+        mode = S_IFDIR;
+    } else {
+        found = fstatat_type(dfd, node->name().data(), &mode) == 0;
+    }
+
+    // We also need to upgrade to tmpfs node if any child:
+    // - Target does not exist
+    // - Source or target is a symlink (since we cannot bind mount symlink)
+    bool cannot_mnt;
+    if (!found) {
+        cannot_mnt = true;
+    } else {
+        node->set_exist(true);
+        cannot_mnt = node->is_lnk() || S_ISLNK(mode);
+    }
+
+    if (cannot_mnt && _node_type > type_id<tmpfs_node>()) {
+        if (cfd >= 0)
+            close(cfd);
+        return CHILD_UNSUPPORTED;
+    }
+    if (dn) {
+        if (replace()) {
+            // Propagate skip mirror state to all children
+            dn->set_replace(true);
+        }
+        // Like path lookup, follow the child if it is a symlink
+        if (cfd < 0 && found)
+            cfd = count_call(STAT_OPEN, [&] {
+                return openat(dfd, dn->name().data(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+            });
+        auto child = new prepare_job;
+        child->dir = dn;
+        child->dfd = cfd;
+        child->parent = &job;
+        child->slot = it;
+        job.left.fetch_add(1);
+        pool.spawn([child, &pool] { child->dir->prepare(*child, pool); });
+    }
+    return cannot_mnt ? CHILD_CANNOT_MOUNT : CHILD_OK;
 }
 
 void dir_node::collect_module_files(const char *module, int dfd) {
     LOGD("collect %s: %s", module, peek_node_path().data());
-    auto dir = xopen_dir(xopenat(dfd, name().data(), O_RDONLY | O_CLOEXEC));
-    if (!dir)
+    int fd = xopenat(dfd, name().data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
         return;
 
-    for (dirent *entry; (entry = xreaddir(dir.get()));) {
-        if (entry->d_name == ".replace"sv) {
-            set_replace(true);
-            continue;
-        }
+    dir_reader dir(fd);
+    children.begin_batch();
+    while (dir.read()) {
+        for (auto entry: dir) {
+            if (entry.name == ".replace"sv) {
+                set_replace(true);
+                continue;
+            }
 
-        if (entry->d_type == DT_DIR) {
-            inter_node *node;
-            if (auto it = children.find(entry->d_name); it == children.end()) {
-                node = emplace<inter_node>(entry->d_name, entry->d_name);
+            if (entry.type == DT_DIR) {
+                inter_node *node;
+                if (auto it = children.find(entry.name); it == children.end()) {
+                    node = emplace<inter_node>(entry.name, entry.name.data());
+                } else {
+                    node = dyn_cast<inter_node>(it->second);
+                }
+                if (node) {
+                    node->collect_module_files(module, fd);
+                }
             } else {
-                node = dyn_cast<inter_node>(it->second);
+                emplace<module_node>(entry.name, module, entry);
             }
-            if (node) {
-                node->collect_module_files(module, dirfd(dir.get()));
+        }
+    }
+    children.commit();
+}
+
+void dir_node::merge_module_files(dir_node *other) {
+    if (other->replace())
+        set_replace(true);
+
+    // Rejected nodes are simply dropped
+    children.begin_batch();
+    for (auto &[_, node]: other->children) {
+        if (isa<inter_node>(node)) {
+            // Same as collect_module_files: only descend into an existing inter_node
+            if (auto it = children.find(node->name()); it == children.end()) {
+                node->_parent = this;
+                children.emplace(node->name(), node);
+            } else if (auto dn = dyn_cast<inter_node>(it->second)) {
+                dn->merge_module_files(static_cast<dir_node *>(node));
             }
         } else {
-            emplace<module_node>(entry->d_name, module, entry);
+            insert(node);
         }
     }
+    children.commit();
+    other->children.clear();
 }
 
 /************************
  * Mount Implementations
  ************************/
 
-void node_entry::create_and_mount(const char *reason, const string &src, bool ro) {
-    const string dest = isa<tmpfs_node>(parent()) ? worker_path() : node_path();
+void node_entry::create_and_mount(const char *reason, const char *src, node_path_buf &path, bool ro) {
+    const char *dest = isa<tmpfs_node>(parent()) ? path.worker() : path.real();
     if (is_lnk()) {
-        VLOGD("cp_link", src.data(), dest.data());
-        cp_afc(src.data(), dest.data());
+        VLOGD("cp_link", src, dest);
+        cp_afc(src, dest, jobs);
     } else {
         if (is_dir())
-            xmkdir(dest.data(), 0);
+            xmkdir(dest, 0);
         else if (is_reg())
-            close(xopen(dest.data(), O_RDONLY | O_CREAT | O_CLOEXEC, 0));
+            close(xopen(dest, O_RDONLY | O_CREAT | O_CLOEXEC, 0));
         else
             return;
-        bind_mount(reason, src.data(), dest.data());
+        bind_mount(reason, src, dest);
         if (ro) {
-            xmount(nullptr, dest.data(), nullptr, MS_REMOUNT | MS_BIND | MS_RDONLY, nullptr);
+            xmount(nullptr, dest, nullptr, MS_REMOUNT | MS_BIND | MS_RDONLY, nullptr);
         }
     }
 }
 
-void module_node::mount() {
-    std::string path = module + (parent()->root()->prefix + node_path());
-    string mnt_src = module_mnt + path;
-    {
-        string src = MODULEROOT "/" + path;
-        if (exist()) clone_attr(node_path().data(), src.data());
-    }
+const char *module_node::source(node_path_buf &path) {
+    // Module files are bound from module_mnt, which is the module root itself
+    return path.src.assign(module_mnt).append(module).append(parent()->root()->prefix)
+            .append(path.real()).data();
+}
+
+void module_node::mount(node_path_buf &path) {
+    const char *src = source(path);
+    if (exist()) clone_attr(path.real(), src);
     if (isa<tmpfs_node>(parent())) {
-        create_and_mount("module", mnt_src);
+        create_and_mount("module", src, path);
     } else {
-        bind_mount("module", mnt_src.data(), node_path().data());
+        count_attach(path.real());
+        bind_mount("module", src, path.real());
     }
 }
 
-void tmpfs_node::mount() {
-    if (!is_dir()) {
-        create_and_mount("mirror", node_path());
+bool dir_node::overlay_options(string_view real, string &opts, vector<string> *layers) {
+    // .replace would be shown in the overlay, and only hides the real entries
+    if (!is_dir() || replace())
+        return false;
+    vector<string_view> modules;
+    string suffix;
+    bool ok = walk(this, suffix, [&](node_entry *node) {
+        if (auto mn = dyn_cast<module_node>(node)) {
+            if (find(modules.begin(), modules.end(), mn->module) == modules.end())
+                modules.emplace_back(mn->module);
+            // Anything else, such as a whiteout, is shown as it is. A directory
+            // collapsed by tree_optimizer only holds files of this module.
+            return mn->is_reg() || mn->is_lnk() || mn->collapsed();
+        }
+        return !node->is_dir() || !static_cast<dir_node *>(node)->replace();
+    });
+    if (!ok || modules.empty())
+        return false;
+
+    // Modules providing the same entry would be shadowed in layer order instead.
+    // Checked on the modules, as the tree only holds the entry that won.
+    sort(modules.begin(), modules.end());
+    vector<string> dirs;
+    for (auto m: modules)
+        dirs.emplace_back(module_mnt).append(m).append(root()->prefix).append(real);
+    string path;
+    mode_t mode;
+    auto in_layer = [&](const string &dir) {
+        path.assign(dir).append(suffix);
+        return fstatat_type(AT_FDCWD, path.data(), &mode) == 0;
+    };
+    ok = walk(this, suffix, [&](node_entry *node) {
+        if (auto mn = dyn_cast<module_node>(node)) {
+            for (size_t i = 0; i < modules.size(); ++i) {
+                if (modules[i] != mn->module && in_layer(dirs[i]))
+                    return false;
+            }
+        } else if (node->is_dir() && !node->exist()) {
+            // Only shown if some module has it, it may be an empty directory.
+            // A module file of that name would be shown instead.
+            return any_of(dirs.begin(), dirs.end(), [&](const string &dir) {
+                return in_layer(dir) && S_ISDIR(mode);
+            });
+        }
+        return true;
+    });
+    if (!ok)
+        return false;
+
+    // Lower layers are separated by ':' in the options, which are separated by ','
+    opts.assign("lowerdir=");
+    for (auto &dir: dirs)
+        opts.append(dir).append(":");
+    opts.append(real);
+    if (opts.size() >= 4096 || opts.find_first_of(",\\", 9) != string::npos ||
+        count(opts.begin(), opts.end(), ':') != static_cast<ptrdiff_t>(dirs.size()))
+        return false;
+    if (layers)
+        *layers = std::move(dirs);
+    return true;
+}
+
+void dir_node::clone_layer_attr(string_view real, const vector<string> &layers) {
+    string suffix;
+    string src(real);
+    string dest;
+    mode_t mode;
+    // The attributes of a directory are the ones of the top layer that has it
+    auto clone_dir = [&] {
+        for (auto &dir: layers) {
+            dest.assign(dir).append(suffix);
+            if (fstatat_type(AT_FDCWD, dest.data(), &mode) == 0) {
+                if (S_ISDIR(mode))
+                    clone_attr(src.data(), dest.data());
+                return;
+            }
+        }
+    };
+    clone_dir();
+    walk(this, suffix, [&](node_entry *node) {
+        if (!node->exist())
+            return true;
+        src.assign(real).append(suffix);
+        if (auto mn = dyn_cast<module_node>(node)) {
+            dest.assign(module_mnt).append(mn->module).append(root()->prefix).append(src);
+            clone_attr(src.data(), dest.data());
+        } else if (node->is_dir()) {
+            clone_dir();
+        }
+        return true;
+    });
+}
+
+// Stack the module directories on the real one with a single overlay, instead of
+// mirroring every real entry into a tmpfs
+static bool mount_overlay(tmpfs_node *node, node_path_buf &path) {
+    static bool unsupported = false;
+    string opts;
+    vector<string> layers;
+    if (unsupported || !node->overlay_options(path.real(), opts, &layers))
+        return false;
+    node->clone_layer_attr(path.real(), layers);
+    VLOGD("overlay", opts.data(), path.real());
+    if (count_call(STAT_MOUNT, [&] {
+        return mount("overlay", path.real(), "overlay", MS_RDONLY, opts.data());
+    }) != 0) {
+        if (errno == ENODEV) {
+            LOGI("overlayfs is not supported, fall back to tmpfs");
+            unsupported = true;
+        } else {
+            PLOGE("overlay %s", path.real());
+        }
+        return false;
+    }
+    count_attach(path.real());
+    xmount(nullptr, path.real(), nullptr, MS_PRIVATE, nullptr);
+    return true;
+}
+
+void tmpfs_node::clone_dir_attr(node_path_buf &path, bool worker_parent) {
+    if (exist()) {
+        clone_attr(path.real(), path.worker(), true);
+    } else {
+        string &dest = path.src;
+        dest.assign(path.worker());
+        path.with_parent([&] {
+            clone_attr(worker_parent ? path.worker() : path.real(), dest.data(), true);
+        });
+    }
+}
+
+// Entries of a directory mounted by one task
+#define POPULATE_CHUNK 64
+
+void tmpfs_node::populate(node_path_buf &path, task_pool &pool) {
+    if (stats_enabled)
+        add_hist(HIST_CHILDREN, children.size());
+    // Cached before the children look it up from several threads
+    root();
+    auto mount_range = [this, &pool](node_path_buf &path, size_t first, size_t last) {
+        for (auto it = children.begin() + first; it != children.begin() + last; ++it) {
+            auto [name, node] = *it;
+            path.push(name);
+            auto tn = dyn_cast<tmpfs_node>(node);
+            if (tn && tn->is_dir() && !tn->collapsed() && !tn->is_empty()) {
+                // The task gets its own copy of the paths
+                pool.spawn([tn, &pool, path]() mutable {
+                    if (stats_enabled)
+                        add_hist(HIST_DEPTH, path.depth());
+                    mkdir(path.worker(), 0);
+                    tn->clone_dir_attr(path, true);
+                    tn->populate(path, pool);
+                });
+            } else {
+                mount_child(node, path);
+            }
+            path.pop(name);
+        }
+    };
+    // The entries of a large directory are independent once it exists
+    size_t n = children.size();
+    for (size_t first = POPULATE_CHUNK; first < n; first += POPULATE_CHUNK) {
+        size_t last = min<size_t>(first + POPULATE_CHUNK, n);
+        pool.spawn([mount_range, path, first, last]() mutable { mount_range(path, first, last); });
+    }
+    mount_range(path, 0, min<size_t>(POPULATE_CHUNK, n));
+}
+
+void tmpfs_node::mount(node_path_buf &path) {
+    if (!is_dir() || collapsed()) {
+        create_and_mount("mirror", path.real(), path);
         return;
     }
     if (!isa<tmpfs_node>(parent())) {
-        auto worker_dir = worker_path();
-        xmkdirs(worker_dir.data(), 0);
-        bind_mount(replace() ? "replace" : "bind", worker_dir.data(), worker_dir.data());
-        clone_attr(exist() ? node_path().data() : parent()->node_path().data(), worker_dir.data());
-        dir_node::mount();
-        bind_mount(replace() ? "replace" : "move", worker_dir.data(), node_path().data(), true);
-        xmount(nullptr, node_path().data(), nullptr, MS_PRIVATE, nullptr);
+        if (use_overlay && mount_overlay(this, path))
+            return;
+        xmkdirs(path.worker(), 0);
+        // With the new mount API the worker dir is populated in place and a detached
+        // copy of its mount tree is attached at once. Otherwise the worker dir becomes
+        // a mount first, which is moved onto the target when populated.
+        if (!new_mount_api)
+            bind_mount(replace() ? "replace" : "bind", path.worker(), path.worker());
+        clone_dir_attr(path, false);
+        set_tree_signature(path.worker(), path.real(), tree_cache::signature(this, path));
+        if (jobs > 1) {
+            // The worker dir is private until it is moved into place, so its
+            // directories are populated concurrently
+            task_pool pool(jobs);
+            pool.spawn([&] { populate(path, pool); });
+            pool.run();
+        } else {
+            dir_node::mount(path);
+        }
+        count_attach(path.real());
+        if (new_mount_api) {
+            VLOGD(replace() ? "replace" : "attach", path.worker(), path.real());
+            if (xattach_tree(path.worker(), path.real()) == 0)
+                return;
+            bind_mount(replace() ? "replace" : "bind", path.worker(), path.worker());
+        }
+        bind_mount(replace() ? "replace" : "move", path.worker(), path.real(), true);
+        xmount(nullptr, path.real(), nullptr, MS_PRIVATE, nullptr);
         // we shouldn't make ro here
     } else {
-        const string dest = worker_path();
         // We don't need another layer of tmpfs if parent is tmpfs
-        mkdir(dest.data(), 0);
-        clone_attr(exist() ? node_path().data() : parent()->worker_path().data(), dest.data());
-        dir_node::mount();
+        mkdir(path.worker(), 0);
+        clone_dir_attr(path, true);
+        dir_node::mount(path);
     }
 }
 
-void load_modules(const vector<module_info> &module_list) {
-    node_entry::module_mnt = MODULEROOT "/";
+// Return the fd of the module directory, or -1 if the module has nothing to mount
+static int open_module(const char *module) {
+    char buf[4096];
+    char *b = buf + snprintf(buf, sizeof(buf), MODULEROOT "/%s/", module);
+
+    // Check whether skip mounting
+    strcpy(b, "skip_mount");
+    if (access(buf, F_OK) == 0)
+        return -1;
+
+    // Double check whether the system folder exists
+    strcpy(b, "system");
+    if (access(buf, F_OK) != 0)
+        return -1;
+
+    b[-1] = '\0';
+    return xopen(buf, O_RDONLY | O_CLOEXEC);
+}
 
-    auto root = make_unique<root_node>("");
+// Collect module files and prepare the tree for mounting
+static root_node *build_tree(const vector<module_info> &module_list, bool under_mounts = false) {
+    auto root = new root_node("");
     auto system = new root_node("system");
     root->insert(system);
 
-    char buf[4096];
     LOGI("* Loading modules");
-    for (const auto &m: module_list) {
-        const char *module = m.name.data();
-        char *b = buf + snprintf(buf, sizeof(buf), MODULEROOT "/%s/", module);
-
-        // Check whether skip mounting
-        strcpy(b, "skip_mount");
-        if (access(buf, F_OK) == 0)
-            continue;
-
-        // Double check whether the system folder exists
-        strcpy(b, "system");
-        if (access(buf, F_OK) != 0)
-            continue;
+    phase_timer collect(PHASE_COLLECT);
+    if (jobs > 1) {
+        // Each module is collected into its own tree in parallel,
+        // then all trees are merged in module order
+        vector<root_node *> trees(module_list.size());
+        parallel_for(module_list.size(), jobs, [&](size_t i) {
+            // Nodes keep the name, which must live as long as the tree
+            const char *module = arena::current()->intern(module_list[i].name).data();
+            int fd = open_module(module);
+            if (fd < 0)
+                return;
+            LOGI("%s: loading mount files", module);
+            trees[i] = new root_node("");
+            auto sys = new root_node("system");
+            trees[i]->insert(sys);
+            sys->collect_module_files(module, fd);
+            close(fd);
+        });
+        for (auto &tree: trees) {
+            if (tree)
+                system->merge_module_files(tree->get_child<root_node>("system"));
+        }
+    } else {
+        for (const auto &m: module_list) {
+            const char *module = arena::current()->intern(m.name).data();
+            int fd = open_module(module);
+            if (fd < 0)
+                continue;
+            LOGI("%s: loading mount files", module);
+            system->collect_module_files(module, fd);
+            close(fd);
+        }
+    }
 
-        LOGI("%s: loading mount files", module);
-        b[-1] = '\0';
-        int fd = xopen(buf, O_RDONLY | O_CLOEXEC);
-        system->collect_module_files(module, fd);
-        close(fd);
+    if (system->is_empty()) {
+        root->extract("system");
+        return root;
     }
 
-    if (!system->is_empty()) {
-        // Handle special read-only partitions
-        for (auto &part: partitions) {
-            struct stat st{};
-            if (!part.empty() && lstat(part.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
-                if (auto old = system->extract(part.c_str() + 1)) {
-                    auto new_node = new root_node(old);
-                    root->insert(new_node);
-                }
+    // Handle special read-only partitions
+    for (auto &part: partitions) {
+        struct stat st{};
+        if (!part.empty() && lstat(part.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (auto old = system->extract(part.c_str() + 1)) {
+                auto new_node = new root_node(old);
+                root->insert(new_node);
             }
         }
+    }
+    collect.stop();
+    phase_timer prepare(PHASE_PREPARE);
+    if (!under_mounts) {
         root->prepare();
-        root->mount();
-    } else {
+    } else if (!root->prepare_under_mounts()) {
+        return nullptr;
+    }
+    if (stage_mounts)
+        root->stage(under_mounts);
+    prepare.stop();
+    if (optimize_tree) {
+        phase_timer t(PHASE_OPTIMIZE);
+        tree_optimizer().run(root);
+    }
+    return root;
+}
+
+void mount_tree(root_node *root) {
+    if (root->is_empty()) {
         LOGI("nothing to mount");
+        return;
+    }
+    phase_timer t(PHASE_MOUNT);
+    node_path_buf path(get_magisk_tmp());
+    root->mount(path);
+}
+
+bool load_modules(const vector<module_info> &module_list, uint64_t key, const char *magic) {
+    node_entry::module_mnt = MODULEROOT "/";
+
+    // All nodes of this run are released at once when returning
+    arena tree_arena;
+    tree_cache cache(key);
+    root_node *root = nullptr;
+    if (!cache_path.empty())
+        root = cache.load(cache_path.data());
+    if (root) {
+        LOGI("* Using cached mount tree");
+    } else {
+        root = build_tree(module_list);
+        if (!cache_path.empty())
+            cache.save(cache_path.data(), root);
     }
+
+    mount_tree(root);
+    bool ok = !verify_mounts || mount_verifier(stdout, magic).run(root);
+
+    auto st = tree_arena.get_stats();
+    LOGD("arena: %zu allocs, %zu names (%zu reused), %zu blocks, %zu KiB",
+         st.allocs, st.names, st.interned, st.blocks, st.bytes / 1024);
+    auto at = get_attr_stats();
+    LOGD("attr: chmod %zu (%zu skipped), chown %zu (%zu skipped), setxattr %zu (%zu skipped), "
+         "%zu reads, %zu contexts", at.chmod, at.skip_chmod, at.chown, at.skip_chown,
+         at.setcon, at.skip_setcon, at.reads, at.contexts);
+    return ok;
 }
 
 template<typename Func>
 static void foreach_module(Func fn) {
-    auto dir = open_dir(MODULEROOT);
-    if (!dir)
+    int dfd = open(MODULEROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0)
         return;
 
-    int dfd = dirfd(dir.get());
-    for (dirent *entry; (entry = xreaddir(dir.get()));) {
-        if (entry->d_type == DT_DIR && entry->d_name != ".core"sv) {
-            int modfd = xopenat(dfd, entry->d_name, O_RDONLY | O_CLOEXEC);
-            fn(dfd, entry, modfd);
-            close(modfd);
+    dir_reader dir(dfd);
+    while (dir.read()) {
+        for (auto entry: dir) {
+            if (entry.type == DT_DIR && entry.name != ".core"sv) {
+                int modfd = xopenat(dfd, entry.name.data(), O_RDONLY | O_CLOEXEC);
+                fn(dfd, entry, modfd);
+                close(modfd);
+            }
+        }
+    }
+}
+
+// Add dir and every directory under it to key. A directory changes its mtime
+// when an entry is added, removed or renamed, but not its attributes.
+static void stamp_tree(int dfd, fingerprint &key) {
+    dir_reader dir(dfd);
+    struct stat st{};
+    if (fstat(dfd, &st) == 0)
+        key.add_mtime(st);
+    while (dir.read()) {
+        for (auto entry: dir) {
+            if (entry.type == DT_DIR) {
+                key.add(entry.name);
+                stamp_tree(openat(dfd, entry.name.data(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC), key);
+            }
         }
     }
 }
 
-void handle_modules() {
+// key is only computed when not null
+static vector<module_info> collect_modules(fingerprint *key) {
     vector<module_info> module_list;
+    if (key) {
+        struct stat st{};
+        if (lstat("/system", &st) == 0)
+            key->add(st);
+        // A cached tree is only optimized if it was built so
+        key->add(optimize_tree ? "optimize"sv : "full"sv);
+        key->add(stage_mounts ? "stage"sv : ""sv);
+        for (auto &part: partitions) {
+            key->add(part);
+            if (lstat(part.data(), &st) == 0)
+                key->add(st);
+        }
+    }
+    phase_timer t(PHASE_ENUMERATE);
     LOGD("collecting modules ...");
-    foreach_module([&](int dfd, dirent *entry, int modfd) {
+    foreach_module([&](int dfd, const dir_entry &entry, int modfd) {
+        if (key) {
+            struct stat st{};
+            key->add(entry.name);
+            if (fstat(modfd, &st) == 0)
+                key->add(st);
+            if (fstatat(modfd, "system", &st, AT_SYMLINK_NOFOLLOW) == 0)
+                key->add(st);
+        }
         // unlinkat(modfd, "update", 0);
         if (faccessat(modfd, "disable", F_OK, 0) == 0)
             return;
+        // Files added deeper in the module only change the directories above them
+        if (key)
+            stamp_tree(openat(modfd, "system", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC), *key);
 
         module_info info;
-        info.name = entry->d_name;
+        info.name = entry.name;
         module_list.push_back(info);
     });
+    return module_list;
+}
+
+bool handle_modules(const char *magic) {
+    // Only computed when the cache is enabled
+    fingerprint key;
+    auto module_list = collect_modules(cache_path.empty() ? nullptr : &key);
     LOGD("loading modules ...");
-    load_modules(module_list);
+    return load_modules(module_list, key.value, magic);
 }
 
 void umount_modules(const char *magic) {
-    vector<string> targets;
-    for (auto &info: parse_mount_info("self")) {
-        if (info.root.starts_with("/adb/modules/") ||
-            (info.source == magic && info.type == "tmpfs")) {
-            targets.emplace_back(info.target);
+    phase_timer t(PHASE_UMOUNT);
+    auto plan = plan_umount(parse_mount_info("self"), magic);
+    for (auto &target: plan.targets) {
+        if (count_call(STAT_UMOUNT, [&] { return umount2(target.c_str(), MNT_DETACH); }) == -1) {
+            PLOGE("umount %s", target.c_str());
+        } else {
+            LOGD("umount %s", target.c_str());
         }
     }
+    LOGI("umount: %zu calls for %zu mounts, %zu covered", plan.targets.size(), plan.mounts, plan.covered);
+}
 
-    for (auto &target: targets) {
-        if (umount2(target.c_str(), MNT_DETACH) == -1) {
-            PLOGE("umount %s", target.c_str());
+vector<string> umount_targets(const char *magic) {
+    return plan_umount(parse_mount_info("self"), magic).targets;
+}
+
+bool umount_pids(const vector<int> &pids, const vector<string> *targets, const char *magic) {
+    phase_timer t(PHASE_UMOUNT);
+    // setns needs the log thread gone, it is started again when done
+    logging::flush();
+    run_finally resume([] { logging::resume(); });
+    int self = xopen("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    if (self < 0)
+        return false;
+    size_t entered = 0, calls = 0, detached = 0;
+    uint64_t total = 0;
+    char pid_str[16];
+    vector<string> live;
+    for (int pid: pids) {
+        auto start = now_ns();
+        if (!targets) {
+            // Read from here, the table of the namespace is the same for every process in it
+            snprintf(pid_str, sizeof(pid_str), "%d", pid);
+            live = plan_umount(parse_mount_info(pid_str), magic).targets;
+        }
+        if (enter_mount_ns(pid) != 0)
+            continue;
+        entered++;
+        // Targets the process no longer has are expected to fail
+        size_t n = 0;
+        for (auto &target: targets ? *targets : live) {
+            if (count_call(STAT_UMOUNT, [&] { return umount2(target.c_str(), MNT_DETACH); }) == 0)
+                n++;
+        }
+        calls += (targets ? *targets : live).size();
+        detached += n;
+        auto ns = now_ns() - start;
+        total += ns;
+        LOGD("umount %d: %zu detached in %.3fms", pid, n, ns / 1e6);
+    }
+    if (setns(self, CLONE_NEWNS) != 0)
+        PLOGE("setns self");
+    close(self);
+    LOGI("umount: %zu of %zu processes, %zu calls, %zu detached, %.3fms per process%s",
+         entered, pids.size(), calls, detached, entered ? total / 1e6 / entered : 0.0,
+         targets ? "" : " (verified)");
+    return entered == pids.size();
+}
+
+// Whether the mount on the target of op is the one op would make
+static bool is_current(const mount_op &op, const mount_info &info, const char *magic) {
+    if (!op.overlay.empty()) {
+        auto opts = "," + info.fs_option + ",";
+        return info.type == "overlay" && opts.find("," + op.overlay + ",") != string::npos;
+    }
+    if (op.source.empty()) {
+        uint64_t sig;
+        return info.type == "tmpfs" && info.source == magic &&
+               get_tree_signature(op.target.data(), info.id, sig) && sig == op.signature;
+    }
+    struct stat st{}, src{};
+    return stat(op.target.data(), &st) == 0 && stat(op.source.data(), &src) == 0 &&
+           st.st_dev == src.st_dev && st.st_ino == src.st_ino;
+}
+
+bool reconcile_modules(const char *magic) {
+    node_entry::module_mnt = MODULEROOT "/";
+
+    arena tree_arena;
+    auto module_list = collect_modules(nullptr);
+    // The tree must not depend on the mounts being reconciled
+    auto root = build_tree(module_list, true);
+    if (!root) {
+        LOGI("reconcile: cannot look under mounts (%s), mount everything again", strerror(errno));
+        umount_modules(magic);
+        root = build_tree(module_list);
+    }
+    bool ok = reconcile_tree(root, magic);
+    return ok && (!verify_mounts || mount_verifier(stdout, magic).run(root));
+}
+
+bool reconcile_tree(root_node *root, const char *magic) {
+    vector<mount_op> ops;
+    node_path_buf path(get_magisk_tmp());
+    root->collect_mounts(path, ops);
+
+    // Match the wanted mounts with the magic mounts on the same targets
+    auto mounts = parse_mount_info("self");
+    auto stacks = find_magic_stacks(mounts, magic);
+    unordered_map<string_view, size_t> live;
+    for (size_t i = 0; i < stacks.size(); ++i)
+        live.emplace(mounts[stacks[i].index].target, i);
+    vector<bool> matched(stacks.size());
+
+    vector<const char *> detach;
+    vector<mount_op *> todo;
+    size_t kept = 0;
+    auto detach_stack = [&](const magic_stack &stack) {
+        auto target = mounts[stack.index].target.data();
+        if (stack.covered) {
+            LOGW("reconcile %s: covered by another mount, skipped", target);
+            return false;
+        }
+        for (size_t n = 0; n < stack.height; ++n)
+            detach.push_back(target);
+        return true;
+    };
+    for (auto &op: ops) {
+        auto it = live.find(op.target);
+        if (it == live.end()) {
+            todo.push_back(&op);
+            continue;
+        }
+        auto &stack = stacks[it->second];
+        matched[it->second] = true;
+        if (stack.height == 1 && !stack.covered && is_current(op, mounts[stack.index], magic)) {
+            kept++;
+        } else if (detach_stack(stack)) {
+            todo.push_back(&op);
+        }
+    }
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        if (!matched[i])
+            detach_stack(stacks[i]);
+    }
+
+    // Stale mounts go first, they may cover the targets of the new ones
+    phase_timer umount(PHASE_UMOUNT);
+    for (auto target: detach) {
+        if (count_call(STAT_UMOUNT, [&] { return umount2(target, MNT_DETACH); }) == -1) {
+            PLOGE("umount %s", target);
         } else {
-            LOGD("umount %s", target.c_str());
+            LOGD("umount %s", target);
+        }
+    }
+    umount.stop();
+    if (!todo.empty()) {
+        if (!mount_work_dir(magic))
+            return false;
+        phase_timer mount(PHASE_MOUNT);
+        for (auto op: todo) {
+            auto rel = string_view(op->target).substr(1);
+            path.push(rel);
+            op->node->mount(path);
+            path.pop(rel);
         }
+        mount.stop();
+        umount_work_dir();
+    }
+    LOGI("reconcile: %zu kept, %zu mounted, %zu detached", kept, todo.size(), detach.size());
+    return true;
+}
+
+root_node *prepare_modules() {
+    node_entry::module_mnt = MODULEROOT "/";
+
+    auto module_list = collect_modules(nullptr);
+    // As if nothing was mounted yet
+    auto root = build_tree(module_list, true);
+    if (!root) {
+        LOGI("prepare: cannot look under mounts (%s), using the current view", strerror(errno));
+        root = build_tree(module_list);
     }
+    return root;
+}
+
+void plan_modules() {
+    arena tree_arena;
+    mount_planner(stdout).run(prepare_modules());
+}
+
+bool verify_modules(const char *magic) {
+    arena tree_arena;
+    return mount_verifier(stdout, magic).run(prepare_modules());
 }
@@ -1,7 +1,14 @@
 #pragma once
 
 #include <sys/mount.h>
-#include <map>
+#include <atomic>
+#include <climits>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "child_map.hpp"
+#include "stats.hpp"
 
 using namespace std;
 
@@ -22,8 +29,84 @@ class tmpfs_node;
 
 class module_node;
 
+class task_pool;
+
 class root_node;
 
+class tree_cache;
+
+class mount_planner;
+
+class tree_optimizer;
+
+class mount_verifier;
+
+class flat_tree;
+
+class task_pool;
+
+// Paths of the node being mounted, kept in one buffer holding the worker path,
+// get_magisk_tmp() followed by the real path. It grows by one component when the
+// traversal descends into a child and shrinks back afterwards, so no path string
+// is built per node.
+class node_path_buf {
+public:
+    explicit node_path_buf(string_view worker_root) : root(worker_root.size()) {
+        buf.reserve(PATH_MAX);
+        buf.assign(worker_root);
+        src.reserve(PATH_MAX);
+    }
+
+    // Real path of the current node, empty for the root
+    const char *real() const { return buf.data() + root; }
+
+    const char *worker() const { return buf.data(); }
+
+    void push(string_view name) {
+        buf.push_back('/');
+        buf.append(name);
+        ++_depth;
+    }
+
+    void pop(string_view name) {
+        buf.resize(buf.size() - name.size() - 1);
+        --_depth;
+    }
+
+    // Components pushed, not counting the worker root
+    size_t depth() const { return _depth; }
+
+    // Run fn with the buffer cut to the paths of the parent of the current node
+    template<class Func>
+    void with_parent(const Func &fn) {
+        auto pos = buf.rfind('/');
+        buf[pos] = '\0';
+        fn();
+        buf[pos] = '/';
+    }
+
+    // Scratch buffer for building other paths, such as module sources
+    string src;
+
+private:
+    string buf;
+    const size_t root;
+    size_t _depth = 0;
+};
+
+// A mount made on the real filesystem by mount(). Mounts into the worker dir
+// are part of the tmpfs they belong to and are not listed.
+struct mount_op {
+    node_entry *node;
+    string target;
+    // Module file bound to target, empty for a tmpfs
+    string source;
+    // Signature of the tmpfs tree, see tree_cache::signature
+    uint64_t signature;
+    // Options of the overlay mounted instead of the tmpfs with --overlay
+    string overlay;
+};
+
 // Poor man's dynamic cast without RTTI
 template<class T>
 static bool isa(node_entry *node);
@@ -32,22 +115,22 @@ template<class T>
 static T *dyn_cast(node_entry *node);
 
 template<class T>
-uint8_t type_id() { return TYPE_CUSTOM; }
+inline uint8_t type_id() { return TYPE_CUSTOM; }
 
 template<>
-uint8_t type_id<dir_node>() { return TYPE_DIR; }
+inline uint8_t type_id<dir_node>() { return TYPE_DIR; }
 
 template<>
-uint8_t type_id<inter_node>() { return TYPE_INTER; }
+inline uint8_t type_id<inter_node>() { return TYPE_INTER; }
 
 template<>
-uint8_t type_id<tmpfs_node>() { return TYPE_TMPFS; }
+inline uint8_t type_id<tmpfs_node>() { return TYPE_TMPFS; }
 
 template<>
-uint8_t type_id<module_node>() { return TYPE_MODULE; }
+inline uint8_t type_id<module_node>() { return TYPE_MODULE; }
 
 template<>
-uint8_t type_id<root_node>() { return TYPE_ROOT; }
+inline uint8_t type_id<root_node>() { return TYPE_ROOT; }
 
 class node_entry {
 public:
@@ -60,73 +143,77 @@ public:
 
     bool is_reg() const { return file_type() == DT_REG; }
 
-    const string &name() const { return _name; }
+    string_view name() const { return _name; }
 
     dir_node *parent() const { return _parent; }
 
-    // Don't call the following two functions before prepare
-    const string &node_path();
-
+    // Build the path of this node, only meant for logging
     string peek_node_path();
 
-    const string worker_path();
+    // path holds the paths of this node
+    virtual void mount(node_path_buf &path) = 0;
+
+    // Nodes live in the arena of the current run and are never freed one by one
+    static void *operator new(size_t size) { return arena::current()->alloc(size, alignof(node_entry)); }
 
-    virtual void mount() = 0;
+    static void operator delete(void *) {}
 
     inline static string module_mnt;
 
 protected:
     template<class T>
-    node_entry(const char *name, uint8_t file_type, T *)
-            : _name(name), _file_type(file_type & 15), _node_type(type_id<T>()) {}
+    node_entry(string_view name, uint8_t file_type, T *)
+            : _name(arena::current()->intern(name)), _file_type(file_type & 15), _node_type(type_id<T>()) {}
 
     template<class T>
     explicit node_entry(T *) : _file_type(0), _node_type(type_id<T>()) {}
 
+    // The other node is dropped, its memory is released with the arena
     virtual void consume(node_entry *other) {
-        _name.swap(other->_name);
+        _name = other->_name;
         _file_type = other->_file_type;
         _parent = other->_parent;
-        delete other;
     }
 
-    void create_and_mount(const char *reason, const string &src, bool ro = false);
+    void create_and_mount(const char *reason, const char *src, node_path_buf &path, bool ro = false);
 
     // Use bit 7 of _file_type for exist status
     bool exist() const { return static_cast<bool>(_file_type & (1 << 7)); }
 
     void set_exist(bool b) { if (b) _file_type |= (1 << 7); else _file_type &= ~(1 << 7); }
 
+    // Use bit 5 of _file_type
+    // The directory is bound as a whole, see tree_optimizer
+    bool collapsed() const { return static_cast<bool>(_file_type & (1 << 5)); }
+
+    void set_collapsed(bool b) { if (b) _file_type |= (1 << 5); else _file_type &= ~(1 << 5); }
+
 private:
     friend class dir_node;
+    friend class tree_cache;
+    friend class mount_planner;
+    friend class tree_optimizer;
+    friend class flat_tree;
+    friend class mount_verifier;
 
     template<class T>
     friend bool isa(node_entry *node);
 
     uint8_t file_type() const { return static_cast<uint8_t>(_file_type & 15); }
 
-    // Node properties
-    string _name;
+    // Node properties, the name is interned in the arena
+    string_view _name;
     dir_node *_parent = nullptr;
 
-    // Cache, it should only be used within prepare
-    string _node_path;
-
     uint8_t _file_type;
     const uint8_t _node_type;
 };
 
 class dir_node : public node_entry {
 public:
-    using map_type = map<string_view, node_entry *>;
+    using map_type = child_map<node_entry>;
     using iterator = map_type::iterator;
 
-    ~dir_node() override {
-        for (auto &it: children)
-            delete it.second;
-        children.clear();
-    }
-
     /**************
      * Entrypoints
      **************/
@@ -134,14 +221,52 @@ public:
     // Traverse through module directories to generate a tree of module files
     void collect_module_files(const char *module, int dfd);
 
+    // Move the tree of a single module, collected separately with collect_module_files,
+    // into this tree. The result is the same as collecting the module here directly.
+    // Nodes of the other tree are either moved into this tree or freed.
+    void merge_module_files(dir_node *other);
+
     // Traverse through the real filesystem and prepare the tree for magic mount.
     // Return true to indicate that this node needs to be upgraded to tmpfs_node.
     bool prepare();
 
+    // Same as above, dfd is an O_PATH fd of the real directory of this node,
+    // or -1 if it does not exist. Children are looked up relative to it.
+    bool prepare(int dfd);
+
+    // Prepare the children of the root, the partitions, against the filesystems
+    // under any mount stacked on them, such as the ones of a previous run.
+    // Return false if the kernel cannot look under mounts.
+    bool prepare_under_mounts();
+
+    // Upgrade the highest directories of each partition that would get more than one
+    // mount on the real filesystem to tmpfs, so they are built in the private work dir
+    // and each is attached with a single mount event. Called on the root after prepare,
+    // the partitions are looked up under mounts as prepare did.
+    void stage(bool under_mounts);
+
+    // Append the mounts mount() would make on the real filesystem to ops, in order
+    void collect_mounts(node_path_buf &path, vector<mount_op> &ops);
+
+    // Options of an overlay showing the same tree as this directory mounted as tmpfs,
+    // with the directories of the modules under it stacked on the real directory at
+    // real. The module directories are added to layers. False if an overlay would
+    // show a different tree.
+    bool overlay_options(string_view real, string &opts, vector<string> *layers = nullptr);
+
+    // Give the module directories and files in layers the attributes of the real
+    // entries they cover, as module_node::mount does for bound files
+    void clone_layer_attr(string_view real, const vector<string> &layers);
+
     // Default directory mount logic
-    void mount() override {
-        for (auto &pair: children)
-            pair.second->mount();
+    void mount(node_path_buf &path) override {
+        if (stats_enabled)
+            add_hist(HIST_CHILDREN, children.size());
+        for (auto &[name, node]: children) {
+            path.push(name);
+            mount_child(node, path);
+            path.pop(name);
+        }
     }
 
     /***************
@@ -197,7 +322,7 @@ protected:
     }
 
     template<class T>
-    dir_node(dirent *entry, T *self) : node_entry(entry->d_name, entry->d_type, self) {
+    dir_node(const dir_entry &entry, T *self) : node_entry(entry.name, entry.type, self) {
         if constexpr (std::is_same_v<T, root_node>)
             _root = self;
     }
@@ -251,12 +376,8 @@ protected:
                     return children.end();
                 if (it->second)
                     node->consume(it->second);
-                it = children.erase(it);
-                // Minor optimization to make insert O(1) by using hint
-                if (it == children.begin())
-                    it = children.emplace(node->_name, node).first;
-                else
-                    it = children.emplace_hint(--it, node->_name, node);
+                // Same name, replace in place so the iterator stays valid
+                it->second = node;
             } else {
                 return children.end();
             }
@@ -280,10 +401,87 @@ protected:
         });
     }
 
+    // Same as above for the children of this node, dfd is an O_PATH fd of its real directory
+    void stage(int dfd);
+
+    // What prepare does with a child once it is prepared
+    enum child_result : uint8_t {
+        CHILD_OK,
+        // Cannot be bound, this directory must become a tmpfs
+        CHILD_CANNOT_MOUNT,
+        // Cannot be bound and this directory cannot become a tmpfs, dropped
+        CHILD_UNSUPPORTED,
+    };
+
+    // A directory being prepared on a task_pool, see prepare(prepare_job &, task_pool &)
+    struct prepare_job {
+        dir_node *dir = nullptr;
+        // O_PATH fd of the real directory or -1, closed when done unless this is a top job
+        int dfd = -1;
+        // Job of the parent directory, null for a top job owned by the caller
+        prepare_job *parent = nullptr;
+        // Slot of dir among the children of the parent
+        iterator slot{};
+        vector<child_result> results;
+        // Child directories not done yet, plus one until all of them are spawned
+        atomic_size_t left = 1;
+        // Whether dir needs to be upgraded to tmpfs_node, once done
+        bool upgrade = false;
+    };
+
+    // Look up the children relative to job.dfd and spawn a job for each child directory.
+    // The last to finish of the directory and its children applies the results in order,
+    // so the tree is the same whatever the order the jobs run in.
+    void prepare(prepare_job &job, task_pool &pool);
+
+    // Apply the results of a job whose children are all done, then report to its parent
+    static void finish_prepare(prepare_job *job);
+
+    // Look up the child at it relative to job.dfd and spawn a job to prepare its subtree.
+    // Only the child and its subtree are changed.
+    child_result prepare_child(iterator it, prepare_job &job, task_pool &pool);
+
+    // Mount a child, path holds its paths
+    static void mount_child(node_entry *node, node_path_buf &path) {
+        if (!stats_enabled) {
+            node->mount(path);
+            return;
+        }
+        add_hist(HIST_DEPTH, path.depth());
+        auto start = node->is_dir() ? 0 : now_ns();
+        node->mount(path);
+        if (start)
+            add_hist(HIST_MOUNT_NS, now_ns() - start);
+    }
+
+    // Mounts mount() would attach on the real filesystem for this node
+    size_t attach_count();
+
     // dir nodes host children
     map_type children;
 
+    // Visit every node under dir, with suffix extended by the path from dir to the
+    // node. Stops and returns false once fn does.
+    template<class Func>
+    static bool walk(dir_node *dir, string &suffix, const Func &fn) {
+        for (auto &[name, node]: dir->children) {
+            suffix.push_back('/');
+            suffix.append(name);
+            auto dn = dyn_cast<dir_node>(node);
+            bool ok = fn(node) && (!dn || !node->is_dir() || walk(dn, suffix, fn));
+            suffix.resize(suffix.size() - name.size() - 1);
+            if (!ok)
+                return false;
+        }
+        return true;
+    }
+
 private:
+    friend class tree_cache;
+    friend class mount_planner;
+    friend class tree_optimizer;
+    friend class flat_tree;
+
     // Root node lookup cache
     root_node *_root = nullptr;
 };
@@ -305,30 +503,55 @@ class inter_node : public dir_node {
 public:
     inter_node(const char *name) : dir_node(name, this) {}
 
-    inter_node(dirent *entry) : dir_node(entry, this) {}
+    inter_node(const dir_entry &entry) : dir_node(entry, this) {}
 };
 
 class module_node : public node_entry {
 public:
-    module_node(const char *module, dirent *entry)
-            : node_entry(entry->d_name, entry->d_type, this), module(module) {}
+    module_node(const char *module, const dir_entry &entry)
+            : node_entry(entry.name, entry.type, this), module(module) {}
 
     module_node(node_entry *node, const char *module) : node_entry(this), module(module) {
         node_entry::consume(node);
     }
 
-    void mount() override;
+    module_node(const char *name, const char *module)
+            : node_entry(name, DT_REG, this), module(module) {}
+
+    void mount(node_path_buf &path) override;
+
+    // Build the path of the module file in path.src
+    const char *source(node_path_buf &path);
 
 private:
+    friend class dir_node;
+    friend class tree_cache;
+    friend class mount_planner;
+    friend class tree_optimizer;
+    friend class flat_tree;
+
     const char *module;
 };
 
 // Don't create tmpfs_node before prepare
 class tmpfs_node : public dir_node {
 public:
-    explicit tmpfs_node(node_entry *node);
+    // The real directory is opened relative to dfd, the fd of the parent directory
+    tmpfs_node(node_entry *node, int dfd);
+
+    // Restore an already prepared node, the real directory is not scanned
+    explicit tmpfs_node(const char *name) : dir_node(name, this) {}
 
-    void mount() override;
+    void mount(node_path_buf &path) override;
+
+private:
+    // A directory that does not exist gets the attributes of its parent,
+    // the worker dir of it if worker_parent
+    void clone_dir_attr(node_path_buf &path, bool worker_parent);
+
+    // Mount the children into the worker dir as tasks of pool, which may run
+    // concurrently. A directory is created before its children are spawned.
+    void populate(node_path_buf &path, task_pool &pool);
 };
 
 template<class T>
@@ -341,18 +564,8 @@ static T *dyn_cast(node_entry *node) {
     return isa<T>(node) ? static_cast<T *>(node) : nullptr;
 }
 
-const string &node_entry::node_path() {
-    if (_parent && _node_path.empty())
-        _node_path = _parent->node_path() + '/' + _name;
-    return _node_path;
-}
-
-string node_entry::peek_node_path() {
+inline string node_entry::peek_node_path() {
     if (_parent)
-        return _parent->peek_node_path() + '/' + _name;
+        return _parent->peek_node_path().append("/").append(_name);
     return "";
 }
-
-const string node_entry::worker_path() {
-    return get_magisk_tmp() + node_path();
-}
@@ -0,0 +1,107 @@
+#include <cstring>
+
+#include "base.hpp"
+#include "node.hpp"
+#include "optimize.hpp"
+
+using namespace std;
+
+bool tree_optimizer::can_collapse(node_entry *node, const subtree &s) {
+    return isa<tmpfs_node>(node) && node->is_dir() && (s.real || (s.single && s.module));
+}
+
+tree_optimizer::subtree tree_optimizer::visit(node_entry *node, string &path, size_t existing) {
+    subtree s;
+    // Same as node_entry::create_and_mount, anything but a directory,
+    // a file or a symlink is not shown in a tmpfs
+    bool shown = node->is_dir() || node->is_reg() || node->is_lnk();
+    if (auto mn = dyn_cast<module_node>(node)) {
+        s.mounts = !node->is_lnk() && shown;
+        s.real = false;
+        s.module = mn->module;
+        // A module file that took the place of a directory is not a directory of it
+        s.single = (node->is_reg() || node->is_lnk()) && !node->exist();
+        return s;
+    }
+    auto dn = dyn_cast<dir_node>(node);
+    if (!dn || !node->is_dir()) {
+        // A real entry mirrored into the tmpfs
+        s.mounts = !node->is_lnk() && shown;
+        s.real = shown;
+        s.single = false;
+        return s;
+    }
+
+    s.real = node->exist() && !dn->replace();
+    // The module of an empty directory is not known
+    s.single = !node->exist() && !dn->replace() && !dn->is_empty();
+    if (node->exist())
+        existing = path.size();
+    vector<subtree> subs;
+    subs.reserve(dn->children.size());
+    for (auto &[name, child]: dn->children) {
+        path.push_back('/');
+        path.append(name);
+        auto &c = subs.emplace_back(visit(child, path, existing));
+        path.resize(path.size() - name.size() - 1);
+        s.mounts += c.mounts;
+        s.real &= c.real;
+        s.single &= c.single;
+        if (c.module && s.module && strcmp(c.module, s.module) != 0)
+            s.single = false;
+        if (!s.module)
+            s.module = c.module;
+    }
+
+    // A directory created in a tmpfs gets the attributes of its parent, down from the
+    // closest real directory, while a bound module directory shows its own
+    if (s.single && s.module) {
+        string real = existing ? path.substr(0, existing) : "/";
+        string src = string(node_entry::module_mnt).append(s.module)
+                .append(dn->root()->prefix).append(path);
+        s.single = same_attr(real.data(), src.data());
+    }
+
+    // Let the parent collapse this node as a whole if it can
+    if (isa<tmpfs_node>(node->_parent) && can_collapse(node, s))
+        return s;
+    if (!isa<tmpfs_node>(node))
+        return s;
+    size_t i = 0;
+    for (auto &[name, child]: dn->children) {
+        auto &c = subs[i++];
+        // A single bind is one mount as well
+        if (c.mounts > 1 && can_collapse(child, c)) {
+            path.push_back('/');
+            path.append(name);
+            collapse_child(child, c, path);
+            path.resize(path.size() - name.size() - 1);
+            s.mounts -= c.mounts - 1;
+        }
+    }
+    return s;
+}
+
+void tree_optimizer::collapse_child(node_entry *&node, const subtree &s, const string &path) {
+    auto &info = _collapsed.emplace_back(collapse{path, s.real, s.module, s.mounts - 1});
+    _saved += info.saved;
+    if (s.real) {
+        LOGD("optimize: %s bound from the real directory, %zu mounts saved",
+             path.data(), info.saved);
+        node->set_collapsed(true);
+        static_cast<dir_node *>(node)->children.clear();
+    } else {
+        LOGD("optimize: %s bound from module %s, %zu mounts saved",
+             path.data(), s.module, info.saved);
+        // The directory of the module replaces the node and everything under it
+        node = new module_node(node, s.module);
+        node->set_collapsed(true);
+    }
+}
+
+void tree_optimizer::run(root_node *root) {
+    string path;
+    visit(root, path, 0);
+    if (!_collapsed.empty())
+        LOGI("optimize: %zu directories collapsed, %zu mounts saved", _collapsed.size(), _saved);
+}
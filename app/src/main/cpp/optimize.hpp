@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class node_entry;
+
+class root_node;
+
+// Pass over a prepared tree, run before it is mounted or cached.
+//
+// Inside a tmpfs every entry is mounted one by one. A directory under a tmpfs is
+// collapsed into a single bind mount when that shows the same tree:
+// - Real: nothing of it comes from a module, the real directory is bound
+// - Module: it does not exist and a single module provides all of it, the module
+//   directory is bound. Its directories must already have the attributes the ones
+//   created in the tmpfs would get, those of the closest real directory.
+// The highest such directory is collapsed, and only if it saves mounts.
+class tree_optimizer {
+public:
+    struct collapse {
+        std::string path;
+        // Bound from the real directory, otherwise from the directory of module
+        bool real;
+        const char *module;
+        size_t saved;
+    };
+
+    void run(root_node *root);
+
+    const std::vector<collapse> &collapsed() const { return _collapsed; }
+
+    size_t saved() const { return _saved; }
+
+private:
+    // What a subtree mounts in a tmpfs, and whether a single bind can replace it
+    struct subtree {
+        size_t mounts = 0;
+        bool real = true;
+        // Set while only this module provides the subtree
+        const char *module = nullptr;
+        bool single = true;
+    };
+
+    // existing is the length of the prefix of path that is the closest real directory
+    subtree visit(node_entry *node, std::string &path, size_t existing);
+
+    // Can a single bind of s replace the directory node
+    static bool can_collapse(node_entry *node, const subtree &s);
+
+    // Replace the map entry node with its collapsed form
+    void collapse_child(node_entry *&node, const subtree &s, const std::string &path);
+
+    std::vector<collapse> _collapsed;
+    size_t _saved = 0;
+};
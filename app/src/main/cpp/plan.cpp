@@ -0,0 +1,232 @@
+#include "main.hpp"
+#include "base.hpp"
+#include "node.hpp"
+#include "plan.hpp"
+
+using namespace std;
+
+enum {
+    OP_MKDIR,
+    OP_CREATE,
+    OP_BIND,
+    OP_MOVE,
+    OP_PRIVATE,
+    OP_ATTACH,
+    OP_ATTR,
+    OP_ATTR_NEW,
+    OP_XATTR,
+    OP_SYMLINK,
+    OP_OVERLAY,
+};
+
+// Estimated syscalls of each operation of mount(), in the order of the enum.
+// Attribute copies are upper bounds, calls that would not change anything
+// are skipped at runtime.
+static constexpr struct {
+    const char *name;
+    uint8_t syscalls;
+    uint8_t xattrs;
+    uint8_t mounts;
+} op_table[] = {
+        {"mkdir", 1, 0, 0},
+        {"create", 2, 0, 0},
+        {"bind", 1, 0, 1},
+        {"move", 1, 0, 1},
+        {"private", 1, 0, 1},
+        // open_tree, mount_setattr and move_mount
+        {"attach", 3, 0, 3},
+        // Source and destination are read, then chmod, chown and setxattr
+        {"attr", 7, 3, 0},
+        // Same for a new file, only the source is read
+        {"attr_new", 5, 2, 0},
+        {"xattr", 1, 1, 0},
+        // lstat, getxattr, unlink, readlink, symlink, lchown and setxattr
+        {"symlink", 7, 2, 0},
+        // mount of the overlay, then made private. Attributes copied to
+        // the module layers are not counted.
+        {"overlay", 2, 0, 2},
+};
+
+static void append_json(string &out, string_view s) {
+    out += '"';
+    for (unsigned char ch: s) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += static_cast<char>(ch);
+        } else if (ch < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            out += buf;
+        } else {
+            out += static_cast<char>(ch);
+        }
+    }
+    out += '"';
+}
+
+static const char *type_name(uint8_t type) {
+    switch (type) {
+        case TYPE_INTER: return "inter";
+        case TYPE_TMPFS: return "tmpfs";
+        case TYPE_MODULE: return "module";
+        case TYPE_ROOT: return "root";
+        default: return "custom";
+    }
+}
+
+static const char *file_type_name(node_entry *node) {
+    if (node->is_dir()) return "dir";
+    if (node->is_reg()) return "file";
+    if (node->is_lnk()) return "symlink";
+    return "other";
+}
+
+void mount_planner::cost::add(const cost &o) {
+    nodes += o.nodes;
+    mounts += o.mounts;
+    tmpfs += o.tmpfs;
+    overlays += o.overlays;
+    collapsed += o.collapsed;
+    mirrors += o.mirrors;
+    modules += o.modules;
+    symlinks += o.symlinks;
+    xattrs += o.xattrs;
+    syscalls += o.syscalls;
+}
+
+void mount_planner::visit(node_entry *node, string &path, string_view partition, cost &c) {
+    path.push_back('/');
+    path.append(node->_name);
+
+    line.assign(R"({"kind":"node","path":)");
+    append_json(line, path);
+    line.append(R"(,"partition":)");
+    append_json(line, partition);
+    line.append(R"(,"type":")").append(type_name(node->_node_type));
+    line.append(R"(","file":")").append(file_type_name(node));
+    line.append(R"(","exist":)").append(node->exist() ? "true" : "false");
+    auto dn = dyn_cast<dir_node>(node);
+    if (dn && node->is_dir())
+        line.append(R"(,"replace":)").append(dn->replace() ? "true" : "false");
+    auto mn = dyn_cast<module_node>(node);
+    if (mn) {
+        line.append(R"(,"module":)");
+        append_json(line, mn->module);
+    }
+    // Bound as a whole, see tree_optimizer
+    bool collapsed = node->collapsed();
+    if (collapsed) {
+        c.collapsed++;
+        line.append(R"(,"collapsed":)").append(mn ? R"("module")" : R"("real")");
+    }
+    line.append(R"(,"ops":[)");
+
+    size_t calls = 0;
+    bool first = true;
+    auto op = [&](int id) {
+        auto &info = op_table[id];
+        if (!first)
+            line += ',';
+        first = false;
+        line.append("\"").append(info.name).append("\"");
+        calls += info.syscalls;
+        c.xattrs += info.xattrs;
+        c.mounts += info.mounts;
+    };
+    // Same as node_entry::create_and_mount
+    auto create = [&] {
+        if (node->is_lnk()) {
+            c.symlinks++;
+            op(OP_SYMLINK);
+        } else if (node->is_dir() || node->is_reg()) {
+            op(node->is_dir() ? OP_MKDIR : OP_CREATE);
+            op(OP_BIND);
+        }
+    };
+
+    // Mirrors tmpfs_node::mount and module_node::mount
+    bool tmpfs_parent = isa<tmpfs_node>(node->_parent);
+    bool overlay_root = false;
+    string opts;
+    if (in_overlay) {
+        // Shown by the overlay of an ancestor
+    } else if (isa<tmpfs_node>(node)) {
+        if (!node->is_dir() || node->collapsed()) {
+            c.mirrors++;
+            create();
+        } else if (!tmpfs_parent && use_overlay && dn->overlay_options(path, opts)) {
+            overlay_root = true;
+            c.overlays++;
+            op(OP_OVERLAY);
+        } else if (!tmpfs_parent) {
+            c.tmpfs++;
+            op(OP_MKDIR);
+            if (!new_mount_api)
+                op(OP_BIND);
+            op(OP_ATTR_NEW);
+            op(OP_XATTR);
+            if (new_mount_api) {
+                op(OP_ATTACH);
+            } else {
+                op(OP_MOVE);
+                op(OP_PRIVATE);
+            }
+        } else {
+            op(OP_MKDIR);
+            op(OP_ATTR_NEW);
+        }
+    } else if (mn) {
+        c.modules++;
+        if (mn->exist())
+            op(OP_ATTR);
+        else if (collapsed)
+            op(OP_ATTR_NEW);
+        if (tmpfs_parent)
+            create();
+        else
+            op(OP_BIND);
+    }
+    c.nodes++;
+    c.syscalls += calls;
+    line.append(R"(],"syscalls":)").append(to_string(calls)).append("}\n");
+    fputs(line.data(), out);
+
+    if (dn) {
+        in_overlay |= overlay_root;
+        for (auto &[_, child]: dn->children)
+            visit(child, path, partition, c);
+        if (overlay_root)
+            in_overlay = false;
+    }
+    path.resize(path.size() - node->_name.size() - 1);
+}
+
+void mount_planner::print(const char *kind, string_view name, const cost &c) {
+    line.assign(R"({"kind":")").append(kind).append("\"");
+    if (!name.empty()) {
+        line.append(R"(,"partition":)");
+        append_json(line, name);
+    }
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             R"(,"nodes":%zu,"mounts":%zu,"tmpfs":%zu,"overlays":%zu,"collapsed":%zu,"mirrors":%zu,"modules":%zu,)"
+             R"("symlinks":%zu,"xattrs":%zu,"syscalls":%zu})" "\n",
+             c.nodes, c.mounts, c.tmpfs, c.overlays, c.collapsed, c.mirrors, c.modules, c.symlinks, c.xattrs, c.syscalls);
+    line.append(buf);
+    fputs(line.data(), out);
+}
+
+void mount_planner::run(root_node *root) {
+    cost total;
+    string path;
+    // Children of the root are the partitions
+    for (auto &[name, node]: root->children) {
+        cost c;
+        string partition("/");
+        partition += name;
+        visit(node, path, partition, c);
+        print("partition", partition, c);
+        total.add(c);
+    }
+    print("total", "", total);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+class node_entry;
+
+class root_node;
+
+// Dry run of mount() over a prepared tree.
+//
+// Every node is printed as one JSON object per line, with its final type and the
+// operations mount() would issue for it, followed by the estimated cost of each
+// partition and the total. Nothing is mounted or written.
+class mount_planner {
+public:
+    explicit mount_planner(FILE *out) : out(out) {}
+
+    void run(root_node *root);
+
+private:
+    struct cost {
+        size_t nodes = 0;
+        // mount(2) calls, or new mount API calls
+        size_t mounts = 0;
+        // tmpfs trees mounted on the real filesystem
+        size_t tmpfs = 0;
+        // Overlays mounted instead of a tmpfs with --overlay
+        size_t overlays = 0;
+        // Directories bound as a whole in a tmpfs, see tree_optimizer
+        size_t collapsed = 0;
+        // Real entries bound or copied back into a tmpfs
+        size_t mirrors = 0;
+        // Module files bound or copied
+        size_t modules = 0;
+        size_t symlinks = 0;
+        // Estimated getxattr and setxattr calls
+        size_t xattrs = 0;
+        size_t syscalls = 0;
+
+        void add(const cost &o);
+    };
+
+    void visit(node_entry *node, std::string &path, std::string_view partition, cost &c);
+
+    void print(const char *kind, std::string_view name, const cost &c);
+
+    FILE *out;
+    std::string line;
+    // Visiting the tree under an overlay, which needs no operation
+    bool in_overlay = false;
+};
@@ -0,0 +1,157 @@
+#include <atomic>
+#include <cstdio>
+
+#include "base.hpp"
+#include "stats.hpp"
+
+bool stats_enabled = false;
+
+event_stats events;
+
+static const char *const phase_names[] = {
+        "enumerate", "collect", "prepare", "optimize", "mount", "remount_ro", "umount", "verify",
+};
+
+static const char *const op_names[] = {
+        "mount", "umount", "open", "getdents", "mkdir", "lstat", "getxattr", "setxattr",
+        "chmod", "chown", "symlink", "readlink", "clone", "copy_file_range", "sendfile",
+};
+
+static const struct {
+    const char *name;
+    const char *unit;
+} hist_names[] = {
+        {"children", "entries"},
+        {"depth", "components"},
+        {"mount_ns", "ns"},
+};
+
+static_assert(std::size(phase_names) == PHASE_COUNT && std::size(op_names) == STAT_OP_COUNT &&
+              std::size(hist_names) == HIST_COUNT);
+
+#define HIST_BUCKETS 64
+
+// Phases run on the main thread
+static uint64_t phase_ns[PHASE_COUNT];
+static bool phase_run[PHASE_COUNT];
+
+static struct {
+    std::atomic_uint64_t calls, errors, ns;
+} op_stats[STAT_OP_COUNT];
+
+// Bucket i holds values of i significant bits, [2^(i-1), 2^i)
+static struct {
+    std::atomic_uint64_t buckets[HIST_BUCKETS + 1];
+    std::atomic_uint64_t count, sum, max;
+} hists[HIST_COUNT];
+
+void add_phase(stat_phase phase, uint64_t ns) {
+    phase_ns[phase] += ns;
+    phase_run[phase] = true;
+}
+
+void add_call(stat_op op, uint64_t ns, bool failed) {
+    auto &s = op_stats[op];
+    s.calls.fetch_add(1, std::memory_order_relaxed);
+    s.ns.fetch_add(ns, std::memory_order_relaxed);
+    if (failed)
+        s.errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+void add_hist(stat_hist hist, uint64_t value) {
+    auto &h = hists[hist];
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    h.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    h.count.fetch_add(1, std::memory_order_relaxed);
+    h.sum.fetch_add(value, std::memory_order_relaxed);
+    for (auto cur = h.max.load(std::memory_order_relaxed);
+         cur < value && !h.max.compare_exchange_weak(cur, value, std::memory_order_relaxed);) {}
+}
+
+void log_phases() {
+    char buf[256];
+    size_t len = 0;
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        if (phase_run[i] && len < sizeof(buf))
+            len += snprintf(buf + len, sizeof(buf) - len, " %s %.3fms", phase_names[i], phase_ns[i] / 1e6);
+    }
+    if (len)
+        LOGI("timing:%s", buf);
+}
+
+void reset_phases() {
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        phase_ns[i] = 0;
+        phase_run[i] = false;
+    }
+}
+
+void log_events() {
+    if (events.tracked)
+        LOGI("events: %zu mounts attached, %zu under shared mounts, %zu mount namespaces",
+             events.attached, events.propagated, events.namespaces);
+}
+
+bool write_stats(const char *path, const char *command) {
+    auto fp = xopen_file(path, "we");
+    if (!fp) {
+        PLOGE("open %s", path);
+        return false;
+    }
+    FILE *f = fp.get();
+
+    fprintf(f, "{\n  \"command\": \"%s\",\n  \"phases_ms\": {", command);
+    const char *sep = "";
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        if (!phase_run[i])
+            continue;
+        fprintf(f, "%s\n    \"%s\": %.3f", sep, phase_names[i], phase_ns[i] / 1e6);
+        sep = ",";
+    }
+
+    fprintf(f, "\n  },\n  \"calls\": {");
+    sep = "";
+    for (int i = 0; i < STAT_OP_COUNT; ++i) {
+        auto &s = op_stats[i];
+        uint64_t calls = s.calls.load(std::memory_order_relaxed);
+        if (!calls)
+            continue;
+        uint64_t ns = s.ns.load(std::memory_order_relaxed);
+        fprintf(f, "%s\n    \"%s\": {\"calls\": %llu, \"errors\": %llu, \"total_us\": %.1f, \"avg_us\": %.2f}",
+                sep, op_names[i], (unsigned long long) calls,
+                (unsigned long long) s.errors.load(std::memory_order_relaxed), ns / 1e3, ns / 1e3 / calls);
+        sep = ",";
+    }
+
+    fprintf(f, "\n  },\n  \"histograms\": {");
+    sep = "";
+    for (int i = 0; i < HIST_COUNT; ++i) {
+        auto &h = hists[i];
+        fprintf(f, "%s\n    \"%s\": {\"unit\": \"%s\", \"count\": %llu, \"sum\": %llu, \"max\": %llu, \"buckets\": [",
+                sep, hist_names[i].name, hist_names[i].unit,
+                (unsigned long long) h.count.load(std::memory_order_relaxed),
+                (unsigned long long) h.sum.load(std::memory_order_relaxed),
+                (unsigned long long) h.max.load(std::memory_order_relaxed));
+        // [lower bound, count] of each bucket that is not empty
+        const char *bsep = "";
+        for (int b = 0; b <= HIST_BUCKETS; ++b) {
+            uint64_t n = h.buckets[b].load(std::memory_order_relaxed);
+            if (!n)
+                continue;
+            fprintf(f, "%s[%llu, %llu]", bsep, b ? 1ULL << (b - 1) : 0ULL, (unsigned long long) n);
+            bsep = ", ";
+        }
+        fprintf(f, "]}");
+        sep = ",";
+    }
+
+    if (events.tracked)
+        fprintf(f, "\n  },\n  \"events\": {\"attached\": %zu, \"propagated\": %zu, \"namespaces\": %zu",
+                events.attached, events.propagated, events.namespaces);
+
+    auto at = get_attr_stats();
+    fprintf(f, "\n  },\n  \"attr\": {\"chmod\": %zu, \"skip_chmod\": %zu, \"chown\": %zu, \"skip_chown\": %zu, "
+               "\"setcon\": %zu, \"skip_setcon\": %zu, \"reads\": %zu, \"contexts\": %zu}\n}\n",
+            at.chmod, at.skip_chmod, at.chown, at.skip_chown, at.setcon, at.skip_setcon, at.reads, at.contexts);
+    return ferror(f) == 0;
+}
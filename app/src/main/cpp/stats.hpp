@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+
+// Phases of a run, always timed and logged when done
+enum stat_phase : uint8_t {
+    PHASE_ENUMERATE,    // list enabled modules
+    PHASE_COLLECT,      // collect module files
+    PHASE_PREPARE,      // look up the real filesystem
+    PHASE_OPTIMIZE,     // collapse subtrees, see tree_optimizer
+    PHASE_MOUNT,
+    PHASE_REMOUNT_RO,   // remount the work dir read-only and detach it
+    PHASE_UMOUNT,
+    PHASE_VERIFY,       // check the mounts against the tree, see mount_verifier
+    PHASE_COUNT,
+};
+
+// Syscalls counted with --stats
+enum stat_op : uint8_t {
+    STAT_MOUNT,
+    STAT_UMOUNT,
+    STAT_OPEN,
+    STAT_GETDENTS,
+    STAT_MKDIR,
+    STAT_LSTAT,
+    STAT_GETXATTR,
+    STAT_SETXATTR,
+    STAT_CHMOD,
+    STAT_CHOWN,
+    STAT_SYMLINK,
+    STAT_READLINK,
+    STAT_CLONE,
+    STAT_COPY_RANGE,
+    STAT_SENDFILE,
+    STAT_OP_COUNT,
+};
+
+// Per node histograms kept with --stats, in power of two buckets
+enum stat_hist : uint8_t {
+    HIST_CHILDREN,      // entries of each directory mounted
+    HIST_DEPTH,         // path depth of each node mounted
+    HIST_MOUNT_NS,      // time to mount each file
+    HIST_COUNT,
+};
+
+// Set by --stats. Counters cost a branch when off, and a clock read
+// and a relaxed atomic add per syscall when on.
+extern bool stats_enabled;
+
+inline uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1'000'000'000ULL + ts.tv_nsec;
+}
+
+void add_phase(stat_phase phase, uint64_t ns);
+
+void add_call(stat_op op, uint64_t ns, bool failed);
+
+void add_hist(stat_hist hist, uint64_t value);
+
+// Run fn, a syscall failing with a negative result, counted as op
+template<class Func>
+inline auto count_call(stat_op op, const Func &fn) {
+    if (!stats_enabled)
+        return fn();
+    auto start = now_ns();
+    auto ret = fn();
+    add_call(op, now_ns() - start, ret < 0);
+    return ret;
+}
+
+// Add the time until the end of the scope to a phase
+class phase_timer {
+public:
+    explicit phase_timer(stat_phase phase) : phase(phase), start(now_ns()) {}
+
+    ~phase_timer() { stop(); }
+
+    // End the phase before the end of the scope
+    void stop() {
+        if (start) {
+            add_phase(phase, now_ns() - start);
+            start = 0;
+        }
+    }
+
+private:
+    const stat_phase phase;
+    uint64_t start;
+};
+
+// Mounts attached on the real filesystem, counted with --stage or --stats. One
+// attached under a shared mount is also made in every namespace of its peer
+// group and their slaves.
+struct event_stats {
+    bool tracked;
+    size_t attached;
+    // Attached under a shared mount
+    size_t propagated;
+    // Mount namespaces when the run started, the most a propagated mount reaches
+    size_t namespaces;
+};
+
+extern event_stats events;
+
+// Log the time of the phases that ran
+void log_phases();
+
+// Forget the phases that ran, so the next log_phases only has the ones after
+void reset_phases();
+
+// Log the attached mounts, if counted
+void log_events();
+
+// Write phases, counters and histograms as JSON
+bool write_stats(const char *path, const char *command);
@@ -0,0 +1,86 @@
+#include <unordered_map>
+
+#include "umount.hpp"
+
+using namespace std;
+
+bool is_magic_mount(const mount_info &info, const char *magic) {
+    return info.root.starts_with("/adb/modules/") || (info.source == magic && info.type == "tmpfs") ||
+           (info.type == "overlay" && info.fs_option.find("lowerdir=" MODULEROOT "/") != string::npos);
+}
+
+vector<magic_stack> find_magic_stacks(const vector<mount_info> &mounts, const char *magic, size_t *count) {
+    vector<magic_stack> stacks;
+    unordered_map<unsigned int, size_t> index;
+    unordered_map<unsigned int, vector<size_t>> children;
+    vector<bool> magic_mount(mounts.size());
+    size_t n_magic = 0;
+    for (size_t i = 0; i < mounts.size(); ++i) {
+        index.emplace(mounts[i].id, i);
+        children[mounts[i].parent].push_back(i);
+        if ((magic_mount[i] = is_magic_mount(mounts[i], magic)))
+            n_magic++;
+    }
+    if (count)
+        *count = n_magic;
+
+    for (size_t i = 0; i < mounts.size(); ++i) {
+        if (!magic_mount[i])
+            continue;
+
+        // Skip if any ancestor is detached anyway
+        bool top = true;
+        for (auto p = index.find(mounts[i].parent); p != index.end() && p->second != i;
+             p = index.find(mounts[p->second].parent)) {
+            if (magic_mount[p->second]) {
+                top = false;
+                break;
+            }
+            // Guard against loops in a table changing while it is read
+            if (mounts[p->second].parent == mounts[p->second].id)
+                break;
+        }
+        if (!top)
+            continue;
+
+        // Mounts stacked on the same path are reached first by umount2
+        magic_stack stack{.index = i, .height = 1, .covered = false};
+        for (size_t cur = i;;) {
+            auto it = children.find(mounts[cur].id);
+            if (it == children.end())
+                break;
+            size_t next = SIZE_MAX;
+            for (auto c: it->second) {
+                if (mounts[c].target == mounts[cur].target) {
+                    next = c;
+                    break;
+                }
+            }
+            if (next == SIZE_MAX)
+                break;
+            if (!magic_mount[next]) {
+                stack.covered = true;
+                break;
+            }
+            stack.height++;
+            cur = next;
+        }
+        stacks.push_back(stack);
+    }
+    return stacks;
+}
+
+umount_plan plan_umount(const vector<mount_info> &mounts, const char *magic) {
+    umount_plan plan;
+    for (auto &stack: find_magic_stacks(mounts, magic, &plan.mounts)) {
+        auto &target = mounts[stack.index].target;
+        if (stack.covered) {
+            LOGW("umount %s: covered by another mount, skipped", target.data());
+            plan.covered++;
+            continue;
+        }
+        for (size_t n = 0; n < stack.height; ++n)
+            plan.targets.push_back(target);
+    }
+    return plan;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "base.hpp"
+
+// Bind mounts of module files, the tmpfs mounted with the magic source
+// and the overlays stacking module directories
+bool is_magic_mount(const mount_info &info, const char *magic);
+
+// A top-most magic mount, the first of a stack of magic mounts on its target
+struct magic_stack {
+    // Index in the mount table
+    size_t index;
+    // Number of magic mounts stacked on the target, including this one
+    size_t height;
+    // A foreign mount is stacked on the magic ones
+    bool covered;
+};
+
+// Build the mount tree from the id and parent of each mount and find the magic
+// mounts without a magic ancestor. A lazy unmount of those also detaches every
+// mount below them. count is set to the number of all magic mounts.
+std::vector<magic_stack> find_magic_stacks(const std::vector<mount_info> &mounts,
+                                           const char *magic, size_t *count = nullptr);
+
+struct umount_plan {
+    // Paths to detach in order. A path is repeated once for every
+    // magic mount stacked on it, as each call only detaches the top one.
+    std::vector<std::string> targets;
+    // Number of magic mounts, one call each when detached one by one
+    size_t mounts = 0;
+    // Top-most magic mounts left alone because a foreign mount is stacked on them
+    size_t covered = 0;
+};
+
+// Detach the top-most magic mounts, so no call is wasted on mounts already gone
+umount_plan plan_umount(const std::vector<mount_info> &mounts, const char *magic);
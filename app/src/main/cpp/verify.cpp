@@ -0,0 +1,122 @@
+#include "main.hpp"
+#include "base.hpp"
+#include "node.hpp"
+#include "cache.hpp"
+#include "umount.hpp"
+#include "stats.hpp"
+#include "verify.hpp"
+
+using namespace std;
+
+// A tmpfs of the work dir without a signature, neither passed nor failed
+static const char *const UNKNOWN = "unknown";
+
+mount_verifier::~mount_verifier() {
+    for (auto &[_, fd]: partitions) {
+        if (fd >= 0)
+            close(fd);
+    }
+}
+
+int mount_verifier::under_mounts(string_view target, string_view &rel) {
+    auto pos = target.find('/', 1);
+    rel = pos == string_view::npos ? "." : target.substr(pos + 1);
+    string part(target.substr(0, pos));
+    auto it = partitions.find(part);
+    if (it == partitions.end()) {
+        int fd = open_under_mounts(part.data());
+        if (fd < 0)
+            LOGW("verify: cannot look under mounts of %s (%s), attributes not checked", part.data(), strerror(errno));
+        it = partitions.emplace(part, fd).first;
+    }
+    return it->second;
+}
+
+bool mount_verifier::same_attr(const mount_op &op, const struct stat &st) {
+    // Entries only modules have keep their own attributes
+    if (!op.node->exist())
+        return true;
+    string_view rel;
+    int dfd = under_mounts(op.target, rel);
+    if (dfd < 0)
+        return true;
+    int fd = openat(dfd, string(rel).data(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        // A real symlink is covered as the file it points to, not checked
+        return errno == ELOOP;
+    }
+    struct stat real{};
+    const char *con, *real_con;
+    bool same = fstat(fd, &real) == 0 && get_con(fd, &real_con) == 0 && get_con(op.target.data(), &con) == 0 &&
+                real.st_mode == st.st_mode && real.st_uid == st.st_uid && real.st_gid == st.st_gid &&
+                con == real_con;
+    close(fd);
+    return same;
+}
+
+const char *mount_verifier::check(const mount_op &op) {
+    struct stat st{};
+    uint64_t id;
+    if (stat_mount(op.target.data(), &st, &id) != 0)
+        return "missing";
+    const mount_info *info = nullptr;
+    if (id) {
+        if (auto it = by_id.find(id); it != by_id.end())
+            info = &mounts[it->second];
+    } else if (auto it = by_target.find(op.target); it != by_target.end()) {
+        info = &mounts[it->second];
+    }
+    if (!info || info->target != op.target)
+        return "unmounted";
+
+    bool source;
+    bool known = true;
+    if (!op.source.empty()) {
+        // The bound module file itself
+        struct stat src{};
+        source = stat(op.source.data(), &src) == 0 && src.st_dev == st.st_dev && src.st_ino == st.st_ino;
+    } else if (auto opts = "," + info->fs_option + ",";
+               !op.overlay.empty() && info->type == "overlay" && opts.find("," + op.overlay + ",") != string::npos) {
+        source = true;
+    } else if (info->type == "tmpfs" && info->source == magic) {
+        // Also where the overlay fell back to a tmpfs
+        uint64_t sig;
+        known = get_tree_signature(op.target.data(), info->id, sig);
+        source = !known || sig == op.signature;
+    } else {
+        source = false;
+    }
+    if (!source)
+        return is_magic_mount(*info, magic) ? "source" : "covered";
+    if (!same_attr(op, st))
+        return "attr";
+    return known ? nullptr : UNKNOWN;
+}
+
+bool mount_verifier::run(root_node *root) {
+    phase_timer t(PHASE_VERIFY);
+    mounts = parse_mount_info("self");
+    for (size_t i = 0; i < mounts.size(); ++i) {
+        by_id.emplace(mounts[i].id, i);
+        // Mounts stacked on a target come after the ones below
+        by_target[mounts[i].target] = i;
+    }
+
+    vector<mount_op> ops;
+    node_path_buf path(get_magisk_tmp());
+    root->collect_mounts(path, ops);
+    size_t failed = 0, unknown = 0;
+    for (auto &op: ops) {
+        if (auto reason = check(op); reason == UNKNOWN) {
+            unknown++;
+            fprintf(out, "unknown %s\n", op.target.data());
+        } else if (reason) {
+            failed++;
+            fprintf(out, "fail %s %s\n", reason, op.target.data());
+        }
+    }
+    size_t passed = ops.size() - failed - unknown;
+    fprintf(out, "verify: %zu mounts, %zu passed, %zu failed, %zu unknown\n", ops.size(), passed, failed, unknown);
+    LOGI("verify: %zu mounts, %zu passed, %zu failed, %zu unknown", ops.size(), passed, failed, unknown);
+    return failed == 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base.hpp"
+
+class root_node;
+
+struct mount_op;
+
+// Check of the mounts of a prepared tree against the mount table, after mount.
+//
+// The table is read once. Each target mount() attaches on the real filesystem is
+// looked up with a single statx, whose mount id gives its entry in the table:
+// - mount: the top mount on the target is a magic mount made on the target itself
+// - source: a bind shows the module file, a tmpfs has the signature of its tree,
+//   an overlay has the layers of its directory
+// - attr: mode, owner and SELinux context are those of the real entry under it
+// A tmpfs without a signature, neither in its xattr nor in TREE_SIGNATURES, is
+// unknown rather than failed. Every failed or unknown target is printed as one
+// line, followed by the totals.
+class mount_verifier {
+public:
+    mount_verifier(FILE *out, const char *magic) : out(out), magic(magic) {}
+
+    ~mount_verifier();
+
+    // True if every mount of the tree is in place
+    bool run(root_node *root);
+
+private:
+    // Reason the mount of op is not in place, UNKNOWN, or null
+    const char *check(const mount_op &op);
+
+    // Whether the attributes at target are the ones of the real entry under it
+    bool same_attr(const mount_op &op, const struct stat &st);
+
+    // Fd of the partition of target seen under mounts, -1 if not supported
+    int under_mounts(std::string_view target, std::string_view &rel);
+
+    FILE *out;
+    const char *magic;
+    std::vector<mount_info> mounts;
+    std::unordered_map<uint64_t, size_t> by_id;
+    // The last mount on each target, where statx does not return the mount id
+    std::unordered_map<std::string_view, size_t> by_target;
+    std::unordered_map<std::string, int> partitions;
+};